@@ -0,0 +1,69 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_ADMISSION_CONTROL_H
+#define GRPC_EXAMPLE_ADMISSION_CONTROL_H
+
+#include <atomic>
+#include <cstdint>
+
+// Decides whether a call that reached a handler is served or shed with RESOURCE_EXHAUSTED. Two signals are used:
+// the calls in flight, and the queue latency - a moving average of the time from Finish until the completion queue
+// hands the handler back, which grows as soon as the queue threads fall behind. Shed calls are cheap (no processing)
+// and still feed the average, so it comes back down once the overload passes.
+class admission_control {
+public:
+    static admission_control &get_admission_control() {
+        static admission_control _admission_control;
+        return _admission_control;
+    }
+
+    // 0 disables the matching watermark.
+    void init(uint32_t max_in_flight, uint32_t max_queue_latency_us) {
+        _max_in_flight = max_in_flight;
+        _max_queue_latency_ns = static_cast<uint64_t>(max_queue_latency_us) * 1000;
+        _in_flight.store(0, std::memory_order_relaxed);
+        _queue_latency_ns.store(0, std::memory_order_relaxed);
+    }
+
+    // An admitted call counts as in flight until release().
+    bool admit() {
+        auto in_flight = _in_flight.fetch_add(1, std::memory_order_relaxed) + 1;
+        if ((_max_in_flight != 0 && in_flight > _max_in_flight) ||
+            (_max_queue_latency_ns != 0 && queue_latency_ns() > _max_queue_latency_ns)) {
+            _in_flight.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    void release() {
+        _in_flight.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void record_queue_latency(uint64_t latency_ns) {
+        // EWMA with a 1/8 weight, concurrent updates may overwrite each other which only loses a sample.
+        auto current = _queue_latency_ns.load(std::memory_order_relaxed);
+        _queue_latency_ns.store(current - current / 8 + latency_ns / 8, std::memory_order_relaxed);
+    }
+
+    uint64_t in_flight() const {
+        return _in_flight.load(std::memory_order_relaxed);
+    }
+
+    uint64_t queue_latency_ns() const {
+        return _queue_latency_ns.load(std::memory_order_relaxed);
+    }
+
+private:
+    admission_control() = default;
+    admission_control(const admission_control &other) = delete;
+
+    uint64_t                            _max_in_flight = 0;
+    uint64_t                            _max_queue_latency_ns = 0;
+    alignas(64) std::atomic<uint64_t>   _in_flight{0};
+    alignas(64) std::atomic<uint64_t>   _queue_latency_ns{0};
+};
+
+#endif //GRPC_EXAMPLE_ADMISSION_CONTROL_H
@@ -0,0 +1,362 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+// Micro-benchmarks of the handler hot path: pool, arena and a full ServerPing round trip over every transport.
+
+#include <mutex>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <grpcpp/grpcpp.h>
+
+#include "server.h"
+#include "memory_pool.h"
+#include "sharded_counter.h"
+
+using namespace example::v1;
+
+constexpr uint16_t BENCH_SERVER_PORT = 16212;
+constexpr const char *BENCH_SERVER_SOCKET = "unix:/tmp/grpc_example_bench.sock";
+constexpr uint64_t BENCH_POOL_SLOTS = 4096;
+
+static mem_pool &bench_pool(mem_pool_mode_e mode) {
+    static mem_pool pools[2];
+    static std::once_flag once[2];
+    std::call_once(once[mode], [mode] {
+        pools[mode].init(handlers_pool::slot_size<handler_server_ping>(), BENCH_POOL_SLOTS, "bench", mode);
+    });
+    return pools[mode];
+}
+
+// Allocate/free pairs, the steady state of handler slots. Runs single and multi threaded on a shared pool.
+static void BM_mem_pool_allocate_deallocate(benchmark::State &state) {
+    auto &pool = bench_pool(static_cast<mem_pool_mode_e>(state.range(0)));
+    for (auto _ : state) {
+        auto node = pool.allocate_node();
+        benchmark::DoNotOptimize(node);
+        pool.deallocate_node(node);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_mem_pool_allocate_deallocate)->ArgName("lock_free")->Arg(MEM_POOL_MODE_LOCKED)->Arg(MEM_POOL_MODE_LOCK_FREE)->ThreadRange(1, 8)->UseRealTime();
+
+// Bursts of allocations released in reverse, as handlers are posted and released on startup/shutdown.
+static void BM_mem_pool_burst(benchmark::State &state) {
+    auto &pool = bench_pool(static_cast<mem_pool_mode_e>(state.range(0)));
+    std::vector<char *> nodes(state.range(1));
+    for (auto _ : state) {
+        for (auto &node : nodes) {
+            node = pool.allocate_node();
+        }
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            pool.deallocate_node(*it);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_mem_pool_burst)->ArgNames({"lock_free", "burst"})->Args({MEM_POOL_MODE_LOCKED, 64})->Args({MEM_POOL_MODE_LOCK_FREE, 64});
+
+// A lock-free pool starting with a single slab taking a burst of burst nodes, growing slab by slab, then giving the
+// extra slabs back to the OS (trim parks one slab per call).
+static void BM_mem_pool_grow_trim(benchmark::State &state) {
+    mem_pool pool;
+    pool.init(handlers_pool::slot_size<handler_server_ping>(), 1, "bench_grow", MEM_POOL_MODE_LOCK_FREE, state.range(0));
+    auto initial_bytes = pool.committed_bytes();
+    std::vector<char *> nodes(state.range(0));
+    for (auto _ : state) {
+        for (auto &node : nodes) {
+            node = pool.allocate_node();
+        }
+        for (auto node : nodes) {
+            pool.deallocate_node(node);
+        }
+        for (auto i = 0; i < 3 * state.range(0) && pool.committed_bytes() > initial_bytes; ++i) {
+            pool.trim(std::chrono::seconds(0));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.counters["committed_mb"] = static_cast<double>(pool.committed_bytes()) / (1024 * 1024);
+    pool.close();
+}
+BENCHMARK(BM_mem_pool_grow_trim)->ArgName("burst")->Arg(1024)->Arg(4096);
+
+// Counting a ping and reading pings_so_far back, as handler_server_ping does, on the sharded counter.
+static void BM_ping_counter_sharded(benchmark::State &state) {
+    static sharded_counter counter;
+    for (auto _ : state) {
+        counter.add(1);
+        benchmark::DoNotOptimize(counter.read());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ping_counter_sharded)->ThreadRange(1, 8)->UseRealTime();
+
+// The same on a single shared atomic, the baseline the sharded counter is measured against.
+static void BM_ping_counter_atomic(benchmark::State &state) {
+    static std::atomic<uint64_t> counter{0};
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(counter.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ping_counter_atomic)->ThreadRange(1, 8)->UseRealTime();
+
+// Building a ServerPingResponse the way handler_server_ping does, on an arena with an initial block and reset per rpc.
+static void BM_server_ping_response_arena(benchmark::State &state) {
+    alignas(16) static char block[handler_base::ARENA_BLOCK_SIZE];
+    ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = sizeof(block);
+    Arena arena(options);
+    ServerPingRequest request;
+    request.mutable_ping()->set_ping_generation(1234);
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        auto *response = Arena::Create<ServerPingResponse>(&arena);
+        *response->mutable_pong()->mutable_ping() = request.ping();
+        response->mutable_pong()->set_pings_so_far(++counter);
+        benchmark::DoNotOptimize(response);
+        arena.Reset();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_server_ping_response_arena);
+
+// Same response on the heap, the baseline the arena is measured against.
+static void BM_server_ping_response_heap(benchmark::State &state) {
+    ServerPingRequest request;
+    request.mutable_ping()->set_ping_generation(1234);
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        auto response = std::make_unique<ServerPingResponse>();
+        *response->mutable_pong()->mutable_ping() = request.ping();
+        response->mutable_pong()->set_pings_so_far(++counter);
+        benchmark::DoNotOptimize(response.get());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_server_ping_response_heap);
+
+static grpc::ByteBuffer serialized_ping_request() {
+    ServerPingRequest request;
+    request.mutable_ping()->set_ping_generation(1731312000);
+    grpc::ByteBuffer buffer;
+    bool own_buffer = false;
+    grpc::SerializationTraits<ServerPingRequest>::Serialize(request, &buffer, &own_buffer);
+    return buffer;
+}
+
+// ServerPing's request to response bytes through protobuf, as handler_server_ping does (parse, build, serialize).
+static void BM_server_ping_codec_protobuf(benchmark::State &state) {
+    alignas(16) static char block[handler_base::ARENA_BLOCK_SIZE];
+    ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = sizeof(block);
+    Arena arena(options);
+    auto request_buffer = serialized_ping_request();
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        auto *request = Arena::Create<ServerPingRequest>(&arena);
+        grpc::ByteBuffer received(request_buffer);
+        grpc::SerializationTraits<ServerPingRequest>::Deserialize(&received, request);
+        auto *response = Arena::Create<ServerPingResponse>(&arena);
+        *response->mutable_pong()->mutable_ping() = request->ping();
+        response->mutable_pong()->set_pings_so_far(++counter);
+        grpc::ByteBuffer buffer;
+        bool own_buffer = false;
+        grpc::SerializationTraits<ServerPingResponse>::Serialize(*response, &buffer, &own_buffer);
+        benchmark::DoNotOptimize(buffer);
+        arena.Reset();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_server_ping_codec_protobuf);
+
+// The same through ping_codec, as handler_server_ping_raw does.
+static void BM_server_ping_codec_raw(benchmark::State &state) {
+    auto request_buffer = serialized_ping_request();
+    std::vector<grpc::Slice> slices;
+    uint64_t counter = 0;
+    for (auto _ : state) {
+        grpc::ByteBuffer received(request_buffer);
+        slices.clear();
+        received.Dump(&slices);
+        uint64_t ping_generation = 0;
+        ping_codec::decode_request(slices[0].begin(), slices[0].size(), ping_generation);
+        uint8_t encoded[ping_codec::MAX_RESPONSE_SIZE];
+        grpc::Slice slice(encoded, ping_codec::encode_response(ping_generation, ++counter, encoded));
+        grpc::ByteBuffer buffer(&slice, 1);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_server_ping_codec_raw);
+
+// What VersionGet used to do per call: build the response and serialize it into the buffer Finish sends.
+static void BM_version_get_response_serialize(benchmark::State &state) {
+    alignas(16) static char block[handler_base::ARENA_BLOCK_SIZE];
+    ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = sizeof(block);
+    Arena arena(options);
+    for (auto _ : state) {
+        auto *response = Arena::Create<VersionGetResponse>(&arena);
+        response->set_version(version_cache::DEFAULT_VERSION);
+        response->set_commit_hash(version_cache::DEFAULT_COMMIT_HASH);
+        grpc::ByteBuffer buffer;
+        bool own_buffer = false;
+        grpc::SerializationTraits<VersionGetResponse>::Serialize(*response, &buffer, &own_buffer);
+        benchmark::DoNotOptimize(buffer);
+        arena.Reset();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_version_get_response_serialize);
+
+// What it does now: check the cache generation and hand the cached bytes to Finish, which takes a reference to them.
+static void BM_version_get_response_cached(benchmark::State &state) {
+    auto &cache = version_cache::get_cache();
+    grpc::ByteBuffer response;
+    uint64_t response_generation = 0;
+    for (auto _ : state) {
+        if (response_generation != cache.generation()) {
+            response_generation = cache.copy_response(response);
+        }
+        grpc::ByteBuffer buffer;
+        bool own_buffer = false;
+        grpc::SerializationTraits<grpc::ByteBuffer>::Serialize(response, &buffer, &own_buffer);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_version_get_response_cached);
+
+enum bench_transport_e {
+    BENCH_TRANSPORT_TCP = 0,
+    BENCH_TRANSPORT_UNIX = 1,
+    BENCH_TRANSPORT_IN_PROCESS = 2
+};
+
+static const char *bench_transport_name(int64_t transport) {
+    switch (transport) {
+        case BENCH_TRANSPORT_TCP:
+            return "tcp";
+        case BENCH_TRANSPORT_UNIX:
+            return "unix";
+        default:
+            return "inprocess";
+    }
+}
+
+static std::unique_ptr<ExampleService::Stub> bench_stub(bench_transport_e transport = BENCH_TRANSPORT_TCP) {
+    if (transport == BENCH_TRANSPORT_IN_PROCESS) {
+        return ExampleService::NewStub(server::get_server().in_process_channel());
+    }
+    auto address = (transport == BENCH_TRANSPORT_UNIX) ? std::string(BENCH_SERVER_SOCKET) : "127.0.0.1:" + std::to_string(BENCH_SERVER_PORT);
+    auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5));
+    return ExampleService::NewStub(channel);
+}
+
+// A full synchronous ServerPing round trip against the server running inside the benchmark process.
+static void BM_server_ping_round_trip(benchmark::State &state) {
+    auto stub = bench_stub();
+    ServerPingRequest request;
+    ServerPingResponse response;
+    uint64_t generation = 0;
+    for (auto _ : state) {
+        grpc::ClientContext context;
+        request.mutable_ping()->set_ping_generation(++generation);
+        auto status = stub->ServerPing(&context, request, &response);
+        if (!status.ok()) {
+            state.SkipWithError(status.error_message().c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_server_ping_round_trip)->ThreadRange(1, 4)->UseRealTime();
+
+// The same round trip over every transport a co-located client can use: loopback TCP, a unix domain socket and an
+// in-process channel.
+static void BM_server_ping_transport(benchmark::State &state) {
+    auto stub = bench_stub(static_cast<bench_transport_e>(state.range(0)));
+    ServerPingRequest request;
+    ServerPingResponse response;
+    uint64_t generation = 0;
+    for (auto _ : state) {
+        grpc::ClientContext context;
+        request.mutable_ping()->set_ping_generation(++generation);
+        auto status = stub->ServerPing(&context, request, &response);
+        if (!status.ok()) {
+            state.SkipWithError(status.error_message().c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(bench_transport_name(state.range(0)));
+}
+BENCHMARK(BM_server_ping_transport)->ArgName("transport")->DenseRange(BENCH_TRANSPORT_TCP, BENCH_TRANSPORT_IN_PROCESS)->ThreadRange(1, 4)->UseRealTime();
+
+// N pings sent as N back to back unary calls, the baseline ServerPingBatch is measured against.
+static void BM_server_ping_unary_n(benchmark::State &state) {
+    auto stub = bench_stub();
+    ServerPingRequest request;
+    ServerPingResponse response;
+    for (auto _ : state) {
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            grpc::ClientContext context;
+            request.mutable_ping()->set_ping_generation(i);
+            auto status = stub->ServerPing(&context, request, &response);
+            if (!status.ok()) {
+                state.SkipWithError(status.error_message().c_str());
+                return;
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_server_ping_unary_n)->ArgName("pings")->Arg(1)->Arg(10)->Arg(100)->UseRealTime();
+
+// The same N pings in a single ServerPingBatch call.
+static void BM_server_ping_batch(benchmark::State &state) {
+    auto stub = bench_stub();
+    ServerPingBatchRequest request;
+    ServerPingBatchResponse response;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        request.add_pings()->set_ping_generation(i);
+    }
+    for (auto _ : state) {
+        grpc::ClientContext context;
+        auto status = stub->ServerPingBatch(&context, request, &response);
+        if (!status.ok()) {
+            state.SkipWithError(status.error_message().c_str());
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_server_ping_batch)->ArgName("pings")->Arg(1)->Arg(10)->Arg(100)->UseRealTime();
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    server_config config = server_config::from_env();
+    config.port = BENCH_SERVER_PORT;
+    config.listeners = BENCH_SERVER_SOCKET;
+    // Keep the server's messages out of the results table.
+    config.log_level = LOG_LEVEL_WARNING;
+    if (!server::get_server().init_server(config)) {
+        return 1;
+    }
+    // The round trip benchmarks compare the two serving modes, run once with GRPC_EXAMPLE_CALLBACK_API=0 and once with 1.
+    benchmark::AddCustomContext("server_api", config.callback_api ? "callback" : "completion_queue");
+
+    benchmark::RunSpecifiedBenchmarks();
+
+    server::get_server().close_server();
+    benchmark::Shutdown();
+    return 0;
+}
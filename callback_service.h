@@ -0,0 +1,246 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_CALLBACK_SERVICE_H
+#define GRPC_EXAMPLE_CALLBACK_SERVICE_H
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/message_allocator.h>
+#include <grpcpp/support/server_callback.h>
+
+#include "admission_control.h"
+#include "handlers.h"
+#include "memory_pool.h"
+#include "server_metrics.h"
+#include "version_cache.h"
+
+// The callback api mode: gRPC runs the rpcs on its own threads and calls the service's methods, there are no
+// completion queues or posted handlers. The rpcs are served with the same process() as the handlers of the completion
+// queue mode, and the reactors and messages come from handlers_pool slots the same way the handlers do.
+
+// The request and response of a unary call on the callback api, both on an arena whose initial block is part of the
+// holder. Holders come from handlers_pool like the handlers, a holder is released with its call: the arena usage is
+// recorded, the arena reset and the slot returned. The holder only comes from the heap if its pool is exhausted.
+template <class Request, class Response>
+class arena_message_holder final : public grpc::MessageHolder<Request, Response> {
+public:
+    arena_message_holder(rpc_method_e method, mem_pool *slot_pool) : _method(method), _slot_pool(slot_pool),
+                                                                     _arena(handler_base::arena_options(_arena_block, sizeof(_arena_block))) {
+        this->set_request(Arena::Create<Request>(&_arena));
+        this->set_response(Arena::Create<Response>(&_arena));
+    }
+
+    void Release() override {
+        server_metrics::get_metrics().record_arena(_method, _arena.SpaceUsed(), _arena.SpaceAllocated() > sizeof(_arena_block));
+        auto slot_pool = _slot_pool;
+        this->~arena_message_holder();
+        if (slot_pool) {
+            slot_pool->deallocate_node(reinterpret_cast<char *>(this));
+        }
+        else {
+            ::operator delete(this);
+        }
+    }
+
+private:
+    rpc_method_e                            _method;
+    mem_pool                                *_slot_pool;
+    alignas(16) char                        _arena_block[handler_base::ARENA_BLOCK_SIZE];
+    Arena                                   _arena;
+};
+
+// Registered for every typed unary rpc of example_callback_service, so gRPC never allocates their messages itself.
+template <class Request, class Response>
+class arena_message_allocator final : public grpc::MessageAllocator<Request, Response> {
+public:
+    using holder = arena_message_holder<Request, Response>;
+
+    explicit arena_message_allocator(rpc_method_e method) : _method(method) {}
+
+    grpc::MessageHolder<Request, Response> *AllocateMessages() override {
+        auto &pool = handlers_pool::get_pool();
+        if (auto slot = pool.allocate<holder>()) {
+            return new (slot) holder(_method, &pool.type_pool<holder>());
+        }
+        server_metrics::get_metrics().increment(SERVER_COUNTER_POOL_EXHAUSTED);
+        return new (::operator new(sizeof(holder))) holder(_method, nullptr);
+    }
+
+private:
+    rpc_method_e                            _method;
+};
+
+using server_ping_allocator = arena_message_allocator<ServerPingRequest, ServerPingResponse>;
+using server_ping_batch_allocator = arena_message_allocator<ServerPingBatchRequest, ServerPingBatchResponse>;
+using server_stats_allocator = arena_message_allocator<ServerStatsRequest, ServerStatsResponse>;
+
+// Finishes a unary call and accounts for it as handler_base does: process and complete latencies, admission control.
+class unary_reactor final : public grpc::ServerUnaryReactor {
+public:
+    explicit unary_reactor(rpc_method_e method) : _method(method) {}
+
+    // Runs process() unless admission control sheds the call, and finishes the call with its status.
+    template <class F>
+    void serve(F &&process) {
+        auto processing_at = server_metrics::clock::now();
+        if (!admission_control::get_admission_control().admit()) {
+            server_metrics::get_metrics().increment(SERVER_COUNTER_SHED);
+            _finished_at = server_metrics::clock::now();
+            Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later"));
+            return;
+        }
+        _admitted = true;
+        auto status = process();
+        _finished_at = server_metrics::clock::now();
+        server_metrics::get_metrics().record(_method, RPC_PHASE_PROCESS, processing_at, _finished_at);
+        Finish(status);
+    }
+
+    void OnDone() override {
+        auto now = server_metrics::clock::now();
+        server_metrics::get_metrics().record(_method, RPC_PHASE_COMPLETE, _finished_at, now);
+        admission_control::get_admission_control().record_queue_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(now - _finished_at).count());
+        if (_admitted) {
+            admission_control::get_admission_control().release();
+        }
+        this->~unary_reactor();
+        handlers_pool::get_pool().type_pool<unary_reactor>().deallocate_node(reinterpret_cast<char *>(this));
+    }
+
+private:
+    rpc_method_e                            _method;
+    server_metrics::clock::time_point       _finished_at;
+    bool                                    _admitted = false;
+};
+
+// ServerPingStream on the callback api, the same ping-pong as handler_server_ping_stream: a single read or write is
+// pending at any time. The request and response are reused for the whole stream.
+class ping_stream_reactor final : public grpc::ServerBidiReactor<ServerPingRequest, ServerPingResponse> {
+public:
+    ping_stream_reactor() {
+        if (!admission_control::get_admission_control().admit()) {
+            server_metrics::get_metrics().increment(SERVER_COUNTER_SHED);
+            finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later"));
+            return;
+        }
+        _admitted = true;
+        StartRead(&_request);
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok) {
+            // The client is done sending pings.
+            finish(grpc::Status::OK);
+            return;
+        }
+        auto processing_at = server_metrics::clock::now();
+        *_response.mutable_pong()->mutable_ping() = _request.ping();
+        _response.mutable_pong()->set_pings_so_far(handler_server_ping::count_ping());
+        server_metrics::get_metrics().record(RPC_METHOD_SERVER_PING_STREAM, RPC_PHASE_PROCESS, processing_at, server_metrics::clock::now());
+        StartWrite(&_response);
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            finish(grpc::Status(grpc::StatusCode::CANCELLED, "pong write failed"));
+            return;
+        }
+        StartRead(&_request);
+    }
+
+    void OnDone() override {
+        server_metrics::get_metrics().record(RPC_METHOD_SERVER_PING_STREAM, RPC_PHASE_COMPLETE, _finished_at, server_metrics::clock::now());
+        if (_admitted) {
+            admission_control::get_admission_control().release();
+        }
+        this->~ping_stream_reactor();
+        handlers_pool::get_pool().type_pool<ping_stream_reactor>().deallocate_node(reinterpret_cast<char *>(this));
+    }
+
+private:
+    void finish(const grpc::Status &status) {
+        _finished_at = server_metrics::clock::now();
+        Finish(status);
+    }
+
+    ServerPingRequest                       _request;
+    ServerPingResponse                      _response;
+    server_metrics::clock::time_point       _finished_at;
+    bool                                    _admitted = false;
+};
+
+// Fails a stream that found handlers_pool exhausted. Rare enough to come from the heap.
+class rejected_stream_reactor final : public grpc::ServerBidiReactor<ServerPingRequest, ServerPingResponse> {
+public:
+    rejected_stream_reactor() {
+        Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later"));
+    }
+
+    void OnDone() override {
+        delete this;
+    }
+};
+
+// VersionGet is served raw from version_cache, as in the completion queue mode. raw_server_ping has no callback
+// counterpart, ServerPing is always typed here.
+class example_callback_service : public ExampleService::WithRawCallbackMethod_VersionGet<ExampleService::CallbackService> {
+public:
+    example_callback_service() {
+        SetMessageAllocatorFor_ServerPing(&_server_ping_allocator);
+        SetMessageAllocatorFor_ServerPingBatch(&_server_ping_batch_allocator);
+        SetMessageAllocatorFor_ServerStats(&_server_stats_allocator);
+    }
+
+    grpc::ServerUnaryReactor *ServerPing(grpc::CallbackServerContext *context, const ServerPingRequest *request, ServerPingResponse *response) override {
+        return serve_unary(context, RPC_METHOD_SERVER_PING, [request, response] { return handler_server_ping::process(*request, *response); });
+    }
+
+    grpc::ServerUnaryReactor *ServerPingBatch(grpc::CallbackServerContext *context, const ServerPingBatchRequest *request, ServerPingBatchResponse *response) override {
+        return serve_unary(context, RPC_METHOD_SERVER_PING_BATCH, [request, response] { return handler_server_ping_batch::process(*request, *response); });
+    }
+
+    grpc::ServerUnaryReactor *ServerStats(grpc::CallbackServerContext *context, const ServerStatsRequest *request, ServerStatsResponse *response) override {
+        return serve_unary(context, RPC_METHOD_SERVER_STATS, [request, response] { return handler_server_stats::process(*request, *response); });
+    }
+
+    grpc::ServerUnaryReactor *VersionGet(grpc::CallbackServerContext *context, const grpc::ByteBuffer *request, grpc::ByteBuffer *response) override {
+        // The response buffer is new for every call, it just takes a reference to the cached bytes.
+        return serve_unary(context, RPC_METHOD_VERSION_GET, [response] {
+            version_cache::get_cache().copy_thread_response(*response);
+            return grpc::Status::OK;
+        });
+    }
+
+    grpc::ServerBidiReactor<ServerPingRequest, ServerPingResponse> *ServerPingStream(grpc::CallbackServerContext *context) override {
+        auto slot = handlers_pool::get_pool().allocate<ping_stream_reactor>();
+        if (slot == nullptr) {
+            server_metrics::get_metrics().increment(SERVER_COUNTER_POOL_EXHAUSTED);
+            return new rejected_stream_reactor();
+        }
+        return new (slot) ping_stream_reactor();
+    }
+
+private:
+    template <class F>
+    static grpc::ServerUnaryReactor *serve_unary(grpc::CallbackServerContext *context, rpc_method_e method, F &&process) {
+        auto slot = handlers_pool::get_pool().allocate<unary_reactor>();
+        if (slot == nullptr) {
+            // Unlike the completion queue mode there is no handler for the call to wait for, it is shed.
+            server_metrics::get_metrics().increment(SERVER_COUNTER_POOL_EXHAUSTED);
+            auto reactor = context->DefaultReactor();
+            reactor->Finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later"));
+            return reactor;
+        }
+        auto reactor = new (slot) unary_reactor(method);
+        reactor->serve(std::forward<F>(process));
+        return reactor;
+    }
+
+    // VersionGet is raw, its buffers only reference slices and there is nothing to allocate for it.
+    server_ping_allocator                   _server_ping_allocator{RPC_METHOD_SERVER_PING};
+    server_ping_batch_allocator             _server_ping_batch_allocator{RPC_METHOD_SERVER_PING_BATCH};
+    server_stats_allocator                  _server_stats_allocator{RPC_METHOD_SERVER_STATS};
+};
+
+#endif //GRPC_EXAMPLE_CALLBACK_SERVICE_H
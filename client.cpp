@@ -1,10 +1,19 @@
 //
 // Created by Dan Cohen on 11/11/2024.
 //
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <string>
+#include <sstream>
 #include <iostream>
+#include <vector>
 #include <grpcpp/grpcpp.h>
-#include "protos/example/v1/example.grpc.pb.h"
+#include "example/v1/example.grpc.pb.h"
+#include "load_generator.h"
+#include "replay.h"
+#include "server.h"
 
 using std::cout;
 using std::endl;
@@ -12,22 +21,252 @@ using std::endl;
 using namespace example::v1;
 
 void usage() {
-	cout << "Usage: grpc_client [p|v]" << endl;
+	cout << "Usage: grpc_client [p|s [count]|v|stats|load [options]|matrix [options]|replay [options]]" << endl;
+        cout << "p, s, v and stats call GRPC_EXAMPLE_CLIENT_ADDRESS (default 127.0.0.1:6212)" << endl;
         cout << "p - send a ping request to the server" << endl;
+        cout << "s - send count pings (default 1000) over a single ServerPingStream" << endl;
         cout << "v - ask the server version" << endl;
+        cout << "stats - print the server's memory stats" << endl;
+        cout << "load - generate load and report throughput and latency, options:" << endl;
+        cout << "    --address=host:port    server address, unix:PATH for a unix domain socket, inprocess to run the" << endl;
+        cout << "                           server inside the client (GRPC_EXAMPLE_* settings) (default 127.0.0.1:6212)" << endl;
+        cout << "    --channels=N           number of channels, each with its own connection and thread (default 1)" << endl;
+        cout << "    --concurrency=N        calls in flight, the in-flight cap when --qps is set (default 16)" << endl;
+        cout << "    --qps=N                open loop target rate, 0 runs closed loop (default 0)" << endl;
+        cout << "    --duration=SEC         test duration in seconds (default 10)" << endl;
+        cout << "    --mix=ping:W,version:W relative weight of every rpc (default ping:1,version:0)" << endl;
+        cout << "matrix - run the load against a server started inside the client, once for every combination of" << endl;
+        cout << "    server settings, and print a line per run, options:" << endl;
+        cout << "    --set=NAME=V1,V2,...   values of a server setting, NAME is its GRPC_EXAMPLE_ variable without the" << endl;
+        cout << "                           prefix, e.g. --set=max_concurrent_streams=16,100 (at least one, repeatable)" << endl;
+        cout << "    --address              where the server listens (default 127.0.0.1:16212), other load options as for load" << endl;
+        cout << "replay - replay a JSONL capture of example.v1.CapturedRequest lines, options:" << endl;
+        cout << "    --input=FILE           capture to replay (required)" << endl;
+        cout << "    --speed=N|max          replay speed relative to the capture offsets (default 1)" << endl;
+        cout << "    --output=FILE          write the latency of every request to a CSV file" << endl;
+        cout << "    --address, --channels, --concurrency as for load, except inprocess (default concurrency 64)" << endl;
 }
 
+static std::string server_address() {
+	auto address = ::getenv("GRPC_EXAMPLE_CLIENT_ADDRESS");
+	return (address != nullptr && *address != '\0') ? address : "127.0.0.1:6212";
+}
+
+static bool parse_mix(const std::string &mix, load_options &options) {
+	std::stringstream stream(mix);
+	std::string item;
+	for (auto &weight : options.weights) {
+		weight = 0;
+	}
+	while (std::getline(stream, item, ',')) {
+		auto colon = item.find(':');
+		if (colon == std::string::npos) {
+			return false;
+		}
+		auto name = item.substr(0, colon);
+		auto weight = std::stoul(item.substr(colon + 1));
+		if (name == "ping") {
+			options.weights[RPC_TYPE_SERVER_PING] = weight;
+		}
+		else if (name == "version") {
+			options.weights[RPC_TYPE_VERSION_GET] = weight;
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
+
+// The values a matrix run takes for a single server setting.
+struct matrix_axis {
+	std::string                 name;
+	std::vector<std::string>    values;
+};
+
+static bool parse_matrix_axis(const std::string &value, std::vector<matrix_axis> &axes) {
+	auto eq = value.find('=');
+	if (eq == 0 || eq == std::string::npos) {
+		return false;
+	}
+	matrix_axis axis;
+	axis.name = value.substr(0, eq);
+	std::transform(axis.name.begin(), axis.name.end(), axis.name.begin(), ::toupper);
+	if (!server_config::is_setting("GRPC_EXAMPLE_" + axis.name)) {
+		cout << "Unknown server setting '" << value.substr(0, eq) << "'" << endl;
+		return false;
+	}
+	std::stringstream stream(value.substr(eq + 1));
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		axis.values.emplace_back(item);
+	}
+	if (axis.values.empty()) {
+		return false;
+	}
+	axes.emplace_back(std::move(axis));
+	return true;
+}
+
+// axes is only given for matrix runs, which take --set on top of the load options.
+static bool parse_load_options(int argc, char **argv, load_options &options, std::vector<matrix_axis> *axes = nullptr) {
+	for (int i = 2; i < argc; ++i) {
+		std::string arg(argv[i]);
+		auto eq = arg.find('=');
+		if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+			cout << "Invalid option '" << arg << "'" << endl;
+			return false;
+		}
+		auto name = arg.substr(2, eq - 2);
+		auto value = arg.substr(eq + 1);
+		try {
+			if (name == "address") {
+				options.address = value;
+			}
+			else if (name == "channels") {
+				options.channels = std::stoul(value);
+			}
+			else if (name == "concurrency") {
+				options.concurrency = std::stoul(value);
+			}
+			else if (name == "qps") {
+				options.qps = std::stod(value);
+			}
+			else if (name == "duration") {
+				options.duration_sec = std::stod(value);
+			}
+			else if (name == "mix") {
+				if (!parse_mix(value, options)) {
+					cout << "Invalid rpc mix '" << value << "'" << endl;
+					return false;
+				}
+			}
+			else if (name == "set" && axes != nullptr) {
+				if (!parse_matrix_axis(value, *axes)) {
+					cout << "Invalid setting values '" << value << "'" << endl;
+					return false;
+				}
+			}
+			else {
+				cout << "Unknown option '" << arg << "'" << endl;
+				return false;
+			}
+		}
+		catch (const std::exception &e) {
+			cout << "Invalid value for option '" << arg << "'" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Starts the server inside the client and has the load generator call it over in-process channels, which measures
+// the server without any transport. The server opens no port, it takes its other settings from the environment.
+static bool start_in_process_server(load_options &options) {
+	auto config = server_config::from_env();
+	config.address.clear();
+	config.listeners.clear();
+	config.log_level = LOG_LEVEL_WARNING;
+	if (!server::get_server().init_server(config)) {
+		cout << "Failed starting the in-process server" << endl;
+		return false;
+	}
+	options.channel_factory = [](uint32_t channel_index) {
+		grpc::ChannelArguments args;
+		args.SetInt("grpc_example.channel_index", static_cast<int>(channel_index));
+		return server::get_server().in_process_channel(args);
+	};
+	return true;
+}
+
+int load(int argc, char **argv) {
+	load_options options;
+	if (!parse_load_options(argc, argv, options)) {
+		usage();
+		return 1;
+	}
+	bool in_process = (options.address == "inprocess");
+	if (in_process && !start_in_process_server(options)) {
+		return 1;
+	}
+
+	cout << "Generating " << (options.qps > 0 ? "open" : "closed") << " loop load on " << options.address
+	     << " for " << options.duration_sec << " sec over " << options.channels << " channel(s), concurrency=" << options.concurrency;
+	if (options.qps > 0) {
+		cout << ", qps=" << options.qps;
+	}
+	cout << endl;
+
+	load_generator generator(options);
+	auto report = generator.run();
+	if (in_process) {
+		server::get_server().close_server();
+	}
+	report.print(cout);
+	return 0;
+}
+
+// Every run gets a new server built from the GRPC_EXAMPLE_* variables with the run's values on top, so the gRPC settings
+// on its ServerBuilder (flow control, keepalive, resource quota...) can be compared without restarting anything. The
+// server shares the machine with the load, the absolute numbers are only good for comparing the runs.
+int matrix(int argc, char **argv) {
+	load_options options;
+	options.address = "127.0.0.1:16212";
+	std::vector<matrix_axis> axes;
+	if (!parse_load_options(argc, argv, options, &axes) || axes.empty() || options.address == "inprocess") {
+		usage();
+		return 1;
+	}
+
+	uint64_t runs = 1;
+	for (auto &axis : axes) {
+		runs *= axis.values.size();
+	}
+	cout << "Running " << runs << " load runs of " << options.duration_sec << " sec on " << options.address << " over "
+	     << options.channels << " channel(s), concurrency=" << options.concurrency << endl;
+	load_report::print_summary_header(cout);
+
+	std::vector<size_t> value_index(axes.size(), 0);
+	while (true) {
+		std::string label;
+		server_config::settings overrides;
+		for (size_t i = 0; i < axes.size(); ++i) {
+			auto &value = axes[i].values[value_index[i]];
+			overrides["GRPC_EXAMPLE_" + axes[i].name] = value;
+			label += (i > 0 ? " " : "") + axes[i].name + "=" + value;
+		}
+
+		auto config = server_config::from_env(overrides);
+		config.address.clear();
+		config.listeners = options.address;
+		config.log_level = LOG_LEVEL_WARNING;
+		if (!server::get_server().init_server(config)) {
+			cout << "Failed starting the server on " << options.address << " with " << label << endl;
+			return 1;
+		}
+		load_generator generator(options);
+		auto report = generator.run();
+		server::get_server().close_server();
+		report.print_summary(cout, label);
+
+		// Next combination, the first axis changes fastest.
+		size_t axis = 0;
+		while (axis < axes.size() && ++value_index[axis] == axes[axis].values.size()) {
+			value_index[axis++] = 0;
+		}
+		if (axis == axes.size()) {
+			break;
+		}
+	}
+	return 0;
+}
 
 void version() {
 	    cout << "Asking for version..." << endl;
-            auto address = std::string("127.0.0.1");
-	    auto port = std::string("6212");
-
             // Starting a grpc client to run the version command.
             std::unique_ptr<ExampleService::Stub>  stub;
             std::shared_ptr<grpc::Channel>      channel;
-            std::string server_address = address + ":" + port;
-            channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+            channel = grpc::CreateChannel(server_address(), grpc::InsecureChannelCredentials());
             stub = ExampleService::NewStub(channel);
 
             // Sending the ping request.
@@ -45,15 +284,29 @@ void version() {
             }
 }
 
+int stats() {
+	auto channel = grpc::CreateChannel(server_address(), grpc::InsecureChannelCredentials());
+	auto stub = ExampleService::NewStub(channel);
+
+	ServerStatsRequest request;
+	ServerStatsResponse response;
+	grpc::ClientContext context;
+	auto ret = stub->ServerStats(&context, request, &response);
+	if (!ret.ok()) {
+		cout << "ServerStats failed with the following error: error_code=" << ret.error_code() << endl;
+		cout << "Error message: '" << ret.error_message() << "'" << endl;
+		return 1;
+	}
+	cout << response.DebugString() << endl;
+	return 0;
+}
+
 void ping() {
 	cout << "Sending ping..." << endl;
-	auto address = std::string("127.0.0.1");
-        auto port = std::string("6212");
         // Starting a grpc client to run the ping command.
         std::unique_ptr<ExampleService::Stub>  stub;
         std::shared_ptr<grpc::Channel>      channel;
-        std::string server_address = address + ":" + port;
-        channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
+        channel = grpc::CreateChannel(server_address(), grpc::InsecureChannelCredentials());
         stub = ExampleService::NewStub(channel);
 
 	// Sending the ping request.
@@ -74,7 +327,123 @@ void ping() {
         }
 }
 
+int ping_stream(uint64_t count) {
+	cout << "Sending " << count << " pings over a stream..." << endl;
+	auto channel = grpc::CreateChannel(server_address(), grpc::InsecureChannelCredentials());
+	auto stub = ExampleService::NewStub(channel);
+
+	grpc::ClientContext context;
+	auto stream = stub->ServerPingStream(&context);
+	ServerPingRequest request;
+	ServerPingResponse response;
+	auto start = std::chrono::steady_clock::now();
+	uint64_t pongs = 0;
+	for (uint64_t i = 1; i <= count; ++i) {
+		request.mutable_ping()->set_ping_generation(i);
+		if (!stream->Write(request) || !stream->Read(&response)) {
+			break;
+		}
+		++pongs;
+	}
+	stream->WritesDone();
+	auto ret = stream->Finish();
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (!ret.ok()) {
+		cout << "Ping stream failed after " << pongs << " pongs with the following error: error_code=" << ret.error_code() << endl;
+		cout << "Error message: '" << ret.error_message() << "'" << endl;
+		return 1;
+	}
+	cout << "Received " << pongs << " pongs in " << elapsed << " sec (" << (elapsed > 0 ? pongs / elapsed : 0.0) << " pings/sec)" << endl;
+	if (pongs != 0) {
+		cout << "Last server pong:" << response.DebugString() << endl;
+	}
+	return 0;
+}
+
+static bool parse_replay_options(int argc, char **argv, replay_options &options) {
+	for (int i = 2; i < argc; ++i) {
+		std::string arg(argv[i]);
+		auto eq = arg.find('=');
+		if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+			cout << "Invalid option '" << arg << "'" << endl;
+			return false;
+		}
+		auto name = arg.substr(2, eq - 2);
+		auto value = arg.substr(eq + 1);
+		try {
+			if (name == "address") {
+				options.address = value;
+			}
+			else if (name == "input") {
+				options.input = value;
+			}
+			else if (name == "output") {
+				options.output = value;
+			}
+			else if (name == "channels") {
+				options.channels = std::stoul(value);
+			}
+			else if (name == "concurrency") {
+				options.concurrency = std::stoul(value);
+			}
+			else if (name == "speed") {
+				options.speed = (value == "max") ? 0 : std::stod(value);
+			}
+			else {
+				cout << "Unknown option '" << arg << "'" << endl;
+				return false;
+			}
+		}
+		catch (const std::exception &e) {
+			cout << "Invalid value for option '" << arg << "'" << endl;
+			return false;
+		}
+	}
+	if (options.input.empty()) {
+		cout << "Missing --input" << endl;
+		return false;
+	}
+	return true;
+}
+
+int replay(int argc, char **argv) {
+	replay_options options;
+	if (!parse_replay_options(argc, argv, options)) {
+		usage();
+		return 1;
+	}
+
+	cout << "Replaying " << options.input << " on " << options.address << " at ";
+	if (options.speed > 0) {
+		cout << options.speed << "x";
+	}
+	else {
+		cout << "max";
+	}
+	cout << " speed over " << options.channels << " channel(s), concurrency=" << options.concurrency << endl;
+
+	replay_engine engine(options);
+	load_report report;
+	if (!engine.run(report)) {
+		return 1;
+	}
+	report.print(cout);
+	return 0;
+}
+
 int main(int argc, char **argv) {
+	if (argc >= 2 && std::string(argv[1]) == "load") {
+		return load(argc, argv);
+	}
+	if (argc >= 2 && std::string(argv[1]) == "matrix") {
+		return matrix(argc, argv);
+	}
+	if (argc >= 2 && std::string(argv[1]) == "replay") {
+		return replay(argc, argv);
+	}
+	if ((argc == 2 || argc == 3) && std::string(argv[1]) == "s") {
+		return ping_stream(argc == 3 ? std::strtoull(argv[2], nullptr, 10) : 1000);
+	}
 	if (argc != 2) {
 		usage();
 		return 1;
@@ -86,6 +455,9 @@ int main(int argc, char **argv) {
 	else if (command == "v") {
 		version();
 	}
+	else if (command == "stats") {
+		return stats();
+	}
 	else {
 		usage();
 		return 1;
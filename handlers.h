@@ -5,18 +5,54 @@
 #ifndef GRPC_EXAMPLE_HANDLERS_H
 #define GRPC_EXAMPLE_HANDLERS_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <type_traits>
+#include <vector>
 #include <grpcpp/grpcpp.h>
 #include <google/protobuf/arena.h>
 
+#include "admission_control.h"
+#include "logger.h"
 #include "memory_pool.h"
+#include "ping_codec.h"
+#include "server_metrics.h"
+#include "server_stats.h"
+#include "sharded_counter.h"
+#include "version_cache.h"
 
 using namespace google::protobuf;
 using namespace example::v1;
 
 using completion_queue_ptr = grpc::ServerCompletionQueue*;
 using completion_queue_sptr = std::unique_ptr<grpc::ServerCompletionQueue>;
-using service_ptr = std::shared_ptr<ExampleService::AsyncService>;
+// VersionGet is served raw, from the response version_cache serialized once. ServerPing is served raw when
+// raw_server_ping is set (it's only known at runtime, hence no WithRawMethod_ServerPing), every other method is typed async.
+class example_service : public ExampleService::WithRawMethod_VersionGet<ExampleService::AsyncService> {
+public:
+    explicit example_service(bool raw_server_ping) {
+        if (raw_server_ping) {
+            MarkMethodRaw(server_ping_method_index());
+        }
+    }
+
+    void RequestServerPingRaw(grpc::ServerContext *context, grpc::ByteBuffer *request, grpc::ServerAsyncResponseWriter<grpc::ByteBuffer> *response,
+                              grpc::CompletionQueue *new_call_cq, grpc::ServerCompletionQueue *notification_cq, void *tag) {
+        RequestAsyncUnary(server_ping_method_index(), context, request, response, new_call_cq, notification_cq, tag);
+    }
+
+private:
+    // gRPC numbers the methods of a service in declaration order, same as the descriptor.
+    static int server_ping_method_index() {
+        static const int index = ServerPingRequest::descriptor()->file()->FindServiceByName("ExampleService")->FindMethodByName("ServerPing")->index();
+        return index;
+    }
+};
+
+using service_ptr = std::shared_ptr<example_service>;
 
 using std::endl;
 using std::cout;
@@ -26,150 +62,603 @@ enum request_state_e {
     REQUEST_STATE_CREATE = 0,
     REQUEST_STATE_PROCESS = 1,
     REQUEST_STATE_COMPLETE = 2,
-    REQUEST_STATE_LAST = 3
+    // Streaming rpcs only, a read or a write of the stream is pending.
+    REQUEST_STATE_READ = 3,
+    REQUEST_STATE_WRITE = 4,
+    REQUEST_STATE_LAST = 5
+};
+
+class handler_base;
+
+// The handlers of one rpc type on one completion queue, so handlers_pool follows the load: base_count handlers are
+// kept armed, when the last armed one takes a call another one is posted (up to max_count), and the extra handlers
+// are released again as calls complete while more than half of base_count are still armed.
+struct handler_group {
+    using create_fn = handler_base *(*)(handler_group &group);
+
+    completion_queue_ptr        completion_queue;
+    service_ptr                 service;
+    uint32_t                    base_count;
+    uint32_t                    max_count;
+    // Allocates, constructs and posts a handler of the group's type, nullptr if handlers_pool is exhausted.
+    create_fn                   create;
+    std::atomic<uint32_t>       total{0};
+    std::atomic<int32_t>        armed{0};
+
+    // Takes a place in the group for a new handler and posts it, false if the group is full or the pool exhausted.
+    bool grow() {
+        auto count = total.load(std::memory_order_relaxed);
+        do {
+            if (count >= max_count) {
+                return false;
+            }
+        } while (!total.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+        if (create(*this) == nullptr) {
+            total.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Gives up the place of a handler that completed its call if the group has more than it needs, the caller then
+    // releases the handler instead of re-arming it.
+    bool shrink() {
+        auto count = total.load(std::memory_order_relaxed);
+        do {
+            if (count <= base_count || armed.load(std::memory_order_relaxed) <= static_cast<int32_t>(base_count / 2)) {
+                return false;
+            }
+        } while (!total.compare_exchange_weak(count, count - 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    // Posts a new handler in place of one that was just released, the group keeps its size.
+    void replace() {
+        if (create(*this) == nullptr) {
+            total.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
 };
 
 class handler_base {
 public:
-    handler_base(completion_queue_ptr completion_queue, service_ptr service) : _completion_queue(completion_queue), _service(service), _arena(nullptr) {
+    // Size of the arena block every handler carries inside its handlers_pool slot, request and response parsing
+    // fit in it so an rpc doesn't touch the heap for its messages.
+    static constexpr size_t ARENA_BLOCK_SIZE = 4096;
+
+    handler_base(completion_queue_ptr completion_queue, service_ptr service, rpc_method_e method) : _completion_queue(completion_queue), _service(service),
+                                                                             _method(method), _arena(arena_options(_arena_block, sizeof(_arena_block))) {
         _state = REQUEST_STATE_CREATE;
+        _live_handlers.fetch_add(1, std::memory_order_relaxed);
     }
     virtual void init_rpc_handler() = 0;
     virtual const std::string get_request_debug_message() = 0;
 
-    virtual void handle_rpc_request() {
-        if (_state == REQUEST_STATE_PROCESS) {
-            cout << "Recieved rpc: "<< get_request_debug_message() << std::endl;
+    virtual void handle_rpc_request() = 0;
 
-            if (process_request()) {
-                reset_and_prepare_handler_for_next_request();
-                _state = REQUEST_STATE_COMPLETE;
-            }
+    virtual ~handler_base() {}
+
+    // Called once the rpc is done (or failed), the handler is re-armed in place for the next call of the same
+    // type. It is destroyed and its slot goes back to handlers_pool when its group shrinks, or once the server stops
+    // accepting calls. A handler whose slot is in a slab handlers_pool is giving back moves to a new slot instead.
+    // The same steps for every handler type, only reset_call() and init_rpc_handler() are the type's own.
+    void complete_request() {
+        if (end_call()) {
+            reset_arena();
+            reset_call();
+            init_rpc_handler();
         }
-        else if (_state == REQUEST_STATE_COMPLETE) {
-            complete_request();
+    }
+
+    // Called when a tag of this handler comes back failed, returns true if that is part of the rpc's normal flow (the
+    // client closing its side of a stream) and was taken care of. Otherwise the server treats it as a failed rpc.
+    virtual bool handle_rpc_failure() {
+        return false;
+    }
+
+    void release() {
+        auto *slot_pool = _slot_pool;
+        this->~handler_base();
+        slot_pool->deallocate_node(reinterpret_cast<char*>(this));
+        if (_live_handlers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard lk(_released_mutex);
+            _released_cv.notify_all();
         }
     }
 
-    virtual ~handler_base() {}
-    virtual void complete_request() {
-	handlers_pool::get_pool().allocator().deallocate_node(reinterpret_cast<char*>(this));
+    // Waits until every handler was released, or until the deadline. Returns the number of handlers left.
+    static uint64_t wait_for_release(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock lk(_released_mutex);
+        _released_cv.wait_until(lk, deadline, [] { return _live_handlers.load(std::memory_order_acquire) == 0; });
+        return _live_handlers.load(std::memory_order_acquire);
+    }
+
+    // Must be called before the handler is first posted, slot_pool is the handlers_pool type pool its slot came from.
+    void attach(handler_group &group, mem_pool &slot_pool) {
+        _group = &group;
+        _slot_pool = &slot_pool;
+    }
+
+    static void start_accepting_requests() {
+        _accepting_requests.store(true, std::memory_order_release);
+    }
+
+    static void stop_accepting_requests() {
+        _accepting_requests.store(false, std::memory_order_release);
+    }
+
+    // Arena options for an arena on an initial block that is part of a pooled slot.
+    static ArenaOptions arena_options(char *initial_block, size_t initial_block_size) {
+        ArenaOptions arena_options;
+        arena_options.initial_block = initial_block;
+        arena_options.initial_block_size = initial_block_size;
+        // Only unusually large messages spill over to heap blocks, those are released by the next reset.
+        arena_options.start_block_size = initial_block_size;
+        arena_options.max_block_size = 16 * initial_block_size;
+        return arena_options;
     }
 protected:
-    virtual void reset_and_prepare_handler_for_next_request() {
-        handler_base *next_handler = new_rpc_handler();
-        next_handler->init_rpc_handler();
+    // A ServerContext (and the responder bound to it) serves a single call, so these two are rebuilt in place while
+    // the slot, the arena and everything else in the handler are kept.
+    virtual void reset_call() {
+        _ctx.~ServerContext();
+        new (&_ctx) grpc::ServerContext();
     }
+
     virtual bool process_request() = 0;
-    virtual handler_base *new_rpc_handler() = 0;
+    // Fails the call with the given status instead of processing it.
+    virtual void reject_request(const grpc::Status &status) = 0;
+
+    // Wraps up a call that is done (or failed). Returns true if the handler is to be re-armed for the next call, which
+    // is then up to the caller, false if it was released.
+    bool end_call() {
+        if (_admitted) {
+            _admitted = false;
+            admission_control::get_admission_control().release();
+        }
+        if (_state == REQUEST_STATE_PROCESS && _group) {
+            // Never got a call, the Request* itself failed.
+            _group->armed.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (!_accepting_requests.load(std::memory_order_acquire) || (_group && _group->shrink())) {
+            release();
+            return false;
+        }
+        if (_group && _slot_pool->in_parking_slab(reinterpret_cast<char *>(this))) {
+            auto group = _group;
+            release();
+            group->replace();
+            return false;
+        }
+        return true;
+    }
+
+    // A call reached the handler: it is timestamped and accounted for, then goes through admission control. Returns
+    // false if the call was shed.
+    bool accept_call() {
+        take_call();
+        _processing_at = server_metrics::clock::now();
+        server_metrics::get_metrics().record(_method, RPC_PHASE_WAIT, _posted_at, _processing_at);
+        SERVER_LOG_SAMPLED(DEBUG) << "Recieved rpc: " << get_request_debug_message();
+        return admit_request();
+    }
+
+    // Runs admission control on a call that just reached the handler, a shed call is failed with RESOURCE_EXHAUSTED
+    // right away and false is returned.
+    bool admit_request() {
+        if (admission_control::get_admission_control().admit()) {
+            _admitted = true;
+            return true;
+        }
+        server_metrics::get_metrics().increment(SERVER_COUNTER_SHED);
+        _state = REQUEST_STATE_COMPLETE;
+        _finished_at = server_metrics::clock::now();
+        reject_request(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded, retry later"));
+        return false;
+    }
+
+    void record_completion() {
+        auto now = server_metrics::clock::now();
+        server_metrics::get_metrics().record(_method, RPC_PHASE_COMPLETE, _finished_at, now);
+        admission_control::get_admission_control().record_queue_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(now - _finished_at).count());
+    }
 
-    void setup_arena_options(google::protobuf::ArenaOptions &arena_options, void *(*alloc_func)(size_t), void (*dealloc_func)(void *,size_t), size_t size) {
-        arena_options.block_alloc = alloc_func;
-        arena_options.block_dealloc = dealloc_func;
-        arena_options.start_block_size = 0;
-        arena_options.max_block_size = size;
-        arena_options.initial_block = nullptr;
-        arena_options.initial_block_size = 0;
+    // Timestamps the handler and counts it as armed before it is posted with Request*, must not be called after
+    // posting since another thread may already be running the handler by then.
+    void mark_posted() {
+        _posted_at = server_metrics::clock::now();
+        if (_group) {
+            _group->armed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // A call reached the handler, the group posts one more handler if this was its last armed one.
+    void take_call() {
+        if (_group && _group->armed.fetch_sub(1, std::memory_order_relaxed) == 1 && _accepting_requests.load(std::memory_order_acquire)) {
+            _group->grow();
+        }
+    }
+
+    void mark_finished() {
+        _finished_at = server_metrics::clock::now();
+        server_metrics::get_metrics().record(_method, RPC_PHASE_PROCESS, _processing_at, _finished_at);
+    }
+
+    // Hands back any overflow blocks, the initial block stays with the slot. What the call used is recorded first.
+    void reset_arena() {
+        server_metrics::get_metrics().record_arena(_method, _arena.SpaceUsed(), _arena.SpaceAllocated() > ARENA_BLOCK_SIZE);
+        _arena.Reset();
     }
 
     completion_queue_ptr                            _completion_queue;
     service_ptr                                     _service;
     grpc::ServerContext                              _ctx;
     request_state_e                                 _state;
-    std::unique_ptr<Arena>                          _arena;
+    rpc_method_e                                    _method;
+    server_metrics::clock::time_point               _posted_at;
+    server_metrics::clock::time_point               _processing_at;
+    server_metrics::clock::time_point               _finished_at;
+    // Whether the current call holds an admission_control in-flight slot.
+    bool                                            _admitted = false;
+    handler_group                                   *_group = nullptr;
+    mem_pool                                        *_slot_pool = nullptr;
+    alignas(16) char                                _arena_block[ARENA_BLOCK_SIZE];
+    Arena                                           _arena;
 
 private:
     handler_base(const handler_base &other) = delete;
+
+    static inline std::atomic_bool                  _accepting_requests{true};
+    // Handlers constructed and not released yet, the last release wakes up wait_for_release().
+    static inline std::atomic<uint64_t>             _live_handlers{0};
+    static inline std::mutex                        _released_mutex;
+    static inline std::condition_variable           _released_cv;
+};
+
+// Request and response types of a unary Request* method of the service, raw methods use grpc::ByteBuffer for both.
+template <class M>
+struct unary_method_traits;
+
+template <class S, class Req, class Resp>
+struct unary_method_traits<void (S::*)(grpc::ServerContext *, Req *, grpc::ServerAsyncResponseWriter<Resp> *, grpc::CompletionQueue *,
+                                       grpc::ServerCompletionQueue *, void *)> {
+    using request = Req;
+    using response = Resp;
 };
 
-class handler_server_ping : public handler_base {
+// The state machine, arena and responder handling shared by every unary rpc, RequestMethod is the service's Request*
+// method of the rpc. A new rpc only has to implement
+//     grpc::Status process(const Request &request, Response &response);
+// in a final Derived class. A static process() that keeps no state in the handler is also what the callback api mode
+// serves the rpc with (see callback_service.h). Processing a call is resolved at compile time, the virtual calls left
+// are the completion queue's dispatch of a tag to its handler and the re-arming in handler_base::complete_request().
+// Protobuf messages are created on the handler's arena for every call. A raw (grpc::ByteBuffer) request or response is
+// a member of the handler instead, a raw response is kept across calls so a handler may reuse it.
+template <class Derived, rpc_method_e Method, auto RequestMethod>
+class unary_handler : public handler_base {
 public:
-    handler_server_ping(completion_queue_ptr completion_queue, service_ptr service) : handler_base(completion_queue, service), _responder(&_ctx) {
-        memory_allocator::reset(_offset, _buffer, 4096);
-        auto alloc = [](size_t size){ return memory_allocator::allocate(_buffer, _offset, size, 4096);};
-        auto dealloc = [](void *ptr, size_t size){ cout << "Freeing " << size << " bytes" << endl; memory_allocator::dealloc(_buffer, _offset, size);};
-        ArenaOptions options;
-        setup_arena_options(options, alloc, dealloc, 4096);
-        _arena = std::make_unique<Arena>(options);
-    }
+    using request_type = typename unary_method_traits<decltype(RequestMethod)>::request;
+    using response_type = typename unary_method_traits<decltype(RequestMethod)>::response;
+    static constexpr bool RAW_REQUEST = std::is_same_v<request_type, grpc::ByteBuffer>;
+    static constexpr bool RAW_RESPONSE = std::is_same_v<response_type, grpc::ByteBuffer>;
 
-    void init_rpc_handler() override {
-        _server_ping_request = Arena::Create<ServerPingRequest>(_arena.get());
-        _service->RequestServerPing(&_ctx, _server_ping_request, &_responder, _completion_queue, _completion_queue, this);
+    unary_handler(completion_queue_ptr completion_queue, service_ptr service) : handler_base(completion_queue, service, Method), _responder(&_ctx) {}
+
+    void init_rpc_handler() final {
+        if constexpr (RAW_REQUEST) {
+            _request = &_raw_request;
+        }
+        else {
+            _request = Arena::Create<request_type>(&_arena);
+        }
         _state = REQUEST_STATE_PROCESS;
+        mark_posted();
+        (_service.get()->*RequestMethod)(&_ctx, _request, &_responder, _completion_queue, _completion_queue, this);
     }
 
     const std::string get_request_debug_message() override {
-        return "[" + ServerPingRequest::descriptor()->name() + "] " + _server_ping_request->ShortDebugString();
+        if constexpr (RAW_REQUEST) {
+            return "[raw] " + std::to_string(_raw_request.Length()) + " bytes";
+        }
+        else {
+            return "[" + request_type::descriptor()->name() + "] " + _request->ShortDebugString();
+        }
     }
-protected:
-    bool process_request() override {
+
+    void handle_rpc_request() final {
         if (_state == REQUEST_STATE_PROCESS) {
-            auto *response = Arena::Create<ServerPingResponse>(_arena.get());
-	    *response->mutable_pong()->mutable_ping() = _server_ping_request->ping();
-	    _ping_counter++;
-	    response->mutable_pong()->set_pings_so_far(_ping_counter);
-            _responder.Finish(*response, grpc::Status::OK, this);
+            if (!accept_call()) {
+                return;
+            }
+            // The state must be set before process_request() posts the response, once it is posted another
+            // thread of the completion queue may pick up the completion and recycle this handler.
+            _state = REQUEST_STATE_COMPLETE;
+            process_request();
+        }
+        else if (_state == REQUEST_STATE_COMPLETE) {
+            record_completion();
+            complete_request();
         }
-        return true;
     }
 
-    handler_base *new_rpc_handler() override {
-        auto new_cmd = (handler_base *)handlers_pool::get_pool().allocator().allocate_node();
-        return new (new_cmd) handler_server_ping(_completion_queue, _service);
+protected:
+    // The request of the current call.
+    const request_type &request() const {
+        return *_request;
+    }
+
+    bool process_request() final {
+        response_type *response = nullptr;
+        if constexpr (RAW_RESPONSE) {
+            response = &_raw_response;
+        }
+        else {
+            response = Arena::Create<response_type>(&_arena);
+        }
+        auto status = static_cast<Derived *>(this)->process(*_request, *response);
+        mark_finished();
+        if (status.ok()) {
+            _responder.Finish(*response, status, this);
+        }
+        else {
+            _responder.FinishWithError(status, this);
+        }
+        return status.ok();
+    }
+
+    void reject_request(const grpc::Status &status) final {
+        _responder.FinishWithError(status, this);
+    }
+
+    void reset_call() final {
+        _responder.~ServerAsyncResponseWriter();
+        handler_base::reset_call();
+        if constexpr (RAW_REQUEST) {
+            _raw_request.Clear();
+        }
+        new (&_responder) grpc::ServerAsyncResponseWriter<response_type>(&_ctx);
     }
 
 private:
-    static inline char _buffer[4096] = {};
-    static inline size_t _offset = 0;
+    request_type                                        *_request = nullptr;
+    grpc::ServerAsyncResponseWriter<response_type>      _responder;
+    grpc::ByteBuffer                                    _raw_request;
+    grpc::ByteBuffer                                    _raw_response;
+};
 
-    ServerPingRequest                                       *_server_ping_request;
-    grpc::ServerAsyncResponseWriter<ServerPingResponse>     _responder;
-    static inline uint64_t                      	    _ping_counter{0};
+class handler_server_ping final : public unary_handler<handler_server_ping, RPC_METHOD_SERVER_PING, &ExampleService::AsyncService::RequestServerPing> {
+public:
+    using unary_handler::unary_handler;
+
+    static grpc::Status process(const ServerPingRequest &request, ServerPingResponse &response) {
+        *response.mutable_pong()->mutable_ping() = request.ping();
+        response.mutable_pong()->set_pings_so_far(count_ping());
+        return grpc::Status::OK;
+    }
+
+    // Pings of every kind (unary, batched and streamed) share the server wide pings_so_far.
+    static uint64_t count_ping() {
+        return count_pings(1);
+    }
+
+    // Accounts count pings at once, returns pings_so_far of the last one. Every queue thread counts pings, the counter
+    // is sharded per core and pings_so_far is its total right after adding: it takes in this ping and every one counted
+    // before it, but pings counted at the same time on other cores may read the same total. Reading it sums every
+    // shard, lines that are only written by the cores counting on them.
+    static uint64_t count_pings(uint64_t count) {
+        _ping_counter.add(count);
+        return _ping_counter.read();
+    }
+
+private:
+    static inline sharded_counter                           _ping_counter;
 };
 
-class handler_version_get : public handler_base {
+// ServerPing in raw mode: the request's ping_generation is decoded straight from the received slices and the response
+// is encoded into a single slice sized up front, no protobuf message is built on either side.
+class handler_server_ping_raw final : public unary_handler<handler_server_ping_raw, RPC_METHOD_SERVER_PING, &example_service::RequestServerPingRaw> {
 public:
-    handler_version_get(completion_queue_ptr completion_queue, service_ptr service) : handler_base(completion_queue, service),
-                                                                                          _responder(&_ctx) {
-        memory_allocator::reset(_offset, _buffer, 4096);
-        auto alloc = [](size_t size){ return memory_allocator::allocate(_buffer, _offset, size, 4096);};
-        auto dealloc = [](void *ptr, size_t size){ memory_allocator::dealloc(_buffer, _offset, size);};
-        ArenaOptions options;
-        setup_arena_options(options, alloc, dealloc, 4096);
-        _arena = std::make_unique<Arena>(options);
+    using unary_handler::unary_handler;
+
+    const std::string get_request_debug_message() override {
+        return "[" + ServerPingRequest::descriptor()->name() + " raw] " + std::to_string(request().Length()) + " bytes";
+    }
+
+    grpc::Status process(const grpc::ByteBuffer &request, grpc::ByteBuffer &response) {
+        uint64_t ping_generation = 0;
+        if (!decode_request(request, ping_generation)) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed ServerPingRequest");
+        }
+
+        uint8_t encoded[ping_codec::MAX_RESPONSE_SIZE];
+        auto size = ping_codec::encode_response(ping_generation, handler_server_ping::count_ping(), encoded);
+        // Responses of up to 23 bytes (any ping_generation below 2^49) are inlined in the slice without an allocation.
+        // Wrapping the slice in a ByteBuffer still allocates a grpc_byte_buffer per call, gRPC has no public API to
+        // refill an existing one.
+        grpc::Slice slice(encoded, size);
+        response = grpc::ByteBuffer(&slice, 1);
+        return grpc::Status::OK;
+    }
+
+private:
+    bool decode_request(const grpc::ByteBuffer &request, uint64_t &ping_generation) {
+        // The slices are referenced, not copied. A request is tiny and nearly always arrives in one slice, otherwise
+        // it is gathered in the arena.
+        _slices.clear();
+        if (!request.Dump(&_slices).ok()) {
+            return false;
+        }
+        if (_slices.size() == 1) {
+            return ping_codec::decode_request(_slices[0].begin(), _slices[0].size(), ping_generation);
+        }
+        auto size = request.Length();
+        auto *data = Arena::CreateArray<uint8_t>(&_arena, size);
+        size_t offset = 0;
+        for (auto &slice : _slices) {
+            ::memcpy(data + offset, slice.begin(), slice.size());
+            offset += slice.size();
+        }
+        return ping_codec::decode_request(data, size, ping_generation);
     }
 
+    // Kept across calls so its capacity is reused.
+    std::vector<grpc::Slice>                                _slices;
+};
+
+// ServerPingBatch answers a whole batch of pings in one call. The pongs are reserved up front so the response is built
+// in a single pass over the arena, and pings_so_far is taken for the whole batch at once: the pongs count up to the
+// total read after adding the batch, so like single pings they may share numbers with pings counted at the same time.
+class handler_server_ping_batch final : public unary_handler<handler_server_ping_batch, RPC_METHOD_SERVER_PING_BATCH,
+                                                             &ExampleService::AsyncService::RequestServerPingBatch> {
+public:
+    using unary_handler::unary_handler;
+
+    static grpc::Status process(const ServerPingBatchRequest &request, ServerPingBatchResponse &response) {
+        auto &pings = request.pings();
+        auto *pongs = response.mutable_pongs();
+        pongs->Reserve(pings.size());
+        auto pings_so_far = handler_server_ping::count_pings(pings.size()) - pings.size();
+        for (auto &ping : pings) {
+            auto *pong = pongs->Add();
+            *pong->mutable_ping() = ping;
+            pong->set_pings_so_far(++pings_so_far);
+        }
+        return grpc::Status::OK;
+    }
+};
+
+class handler_version_get final : public unary_handler<handler_version_get, RPC_METHOD_VERSION_GET, &example_service::RequestVersionGet> {
+public:
+    using unary_handler::unary_handler;
+
+    const std::string get_request_debug_message() override {
+        return "[" + VersionGetRequest::descriptor()->name() + "] " + std::to_string(request().Length()) + " bytes";
+    }
+
+    grpc::Status process(const grpc::ByteBuffer &request, grpc::ByteBuffer &response) {
+        // VersionGetRequest has no fields, the raw request isn't even parsed. The raw response is kept across calls,
+        // it holds this handler's reference to the cached response.
+        auto &cache = version_cache::get_cache();
+        if (_response_generation != cache.generation()) {
+            _response_generation = cache.copy_response(response);
+        }
+        return grpc::Status::OK;
+    }
+
+private:
+    uint64_t                                                _response_generation = 0;
+};
+
+// ServerStats, the server's memory usage taken on every call.
+class handler_server_stats final : public unary_handler<handler_server_stats, RPC_METHOD_SERVER_STATS, &ExampleService::AsyncService::RequestServerStats> {
+public:
+    using unary_handler::unary_handler;
+
+    static grpc::Status process(const ServerStatsRequest &request, ServerStatsResponse &response) {
+        collect_server_stats(response);
+        return grpc::Status::OK;
+    }
+};
+
+// Serves one ServerPingStream at a time: reads a ping, writes its pong, then reads the next one, so there is a single
+// operation pending on the stream at any time. The arena is reset after every pong, a long stream doesn't grow it.
+class handler_server_ping_stream : public handler_base {
+public:
+    handler_server_ping_stream(completion_queue_ptr completion_queue, service_ptr service) : handler_base(completion_queue, service, RPC_METHOD_SERVER_PING_STREAM),
+                                                                                             _stream(&_ctx) {}
+
     void init_rpc_handler() override {
-        _version_get_request = Arena::Create<VersionGetRequest>(_arena.get());
-        _service->RequestVersionGet(&_ctx, _version_get_request, &_responder, _completion_queue, _completion_queue, this);
+        _server_ping_request = Arena::Create<ServerPingRequest>(&_arena);
         _state = REQUEST_STATE_PROCESS;
+        mark_posted();
+        _service->RequestServerPingStream(&_ctx, &_stream, _completion_queue, _completion_queue, this);
     }
 
     const std::string get_request_debug_message() override {
-        return "[" + VersionGetRequest::descriptor()->name() + "] " + _version_get_request->ShortDebugString();
+        return "[" + ServerPingRequest::descriptor()->name() + " stream] " + _server_ping_request->ShortDebugString();
+    }
+
+    void handle_rpc_request() override {
+        switch (_state) {
+            case REQUEST_STATE_PROCESS:
+                // A new stream, wait for its first ping.
+                take_call();
+                server_metrics::get_metrics().record(_method, RPC_PHASE_WAIT, _posted_at, server_metrics::clock::now());
+                SERVER_LOG_SAMPLED(DEBUG) << "Accepted ServerPingStream from " << _ctx.peer();
+                if (admit_request()) {
+                    read_next_ping();
+                }
+                break;
+            case REQUEST_STATE_READ:
+                _processing_at = server_metrics::clock::now();
+                process_request();
+                break;
+            case REQUEST_STATE_WRITE:
+                reset_arena();
+                _server_ping_request = Arena::Create<ServerPingRequest>(&_arena);
+                read_next_ping();
+                break;
+            case REQUEST_STATE_COMPLETE:
+                record_completion();
+                complete_request();
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool handle_rpc_failure() override {
+        switch (_state) {
+            case REQUEST_STATE_READ:
+                // The client is done sending pings.
+                finish(grpc::Status::OK);
+                return true;
+            case REQUEST_STATE_WRITE:
+                // The stream is broken (client gone or call cancelled), there is no one to send a status to.
+                finish(grpc::Status(grpc::StatusCode::CANCELLED, "pong write failed"));
+                return true;
+            case REQUEST_STATE_COMPLETE:
+                complete_request();
+                return true;
+            default:
+                return false;
+        }
     }
 protected:
     bool process_request() override {
-        if (_state == REQUEST_STATE_PROCESS) {
-            auto *response = Arena::Create<VersionGetResponse>(_arena.get());
-            response->set_version("v1.1");
-	    response->set_commit_hash("abc123");
-            _responder.Finish(*response, grpc::Status::OK, this);
-        }
+        auto *response = Arena::Create<ServerPingResponse>(&_arena);
+        *response->mutable_pong()->mutable_ping() = _server_ping_request->ping();
+        response->mutable_pong()->set_pings_so_far(handler_server_ping::count_ping());
+        _state = REQUEST_STATE_WRITE;
+        server_metrics::get_metrics().record(_method, RPC_PHASE_PROCESS, _processing_at, server_metrics::clock::now());
+        _stream.Write(*response, this);
         return true;
     }
 
-    handler_base *new_rpc_handler() override {
-        auto new_cmd = (handler_base *)handlers_pool::get_pool().allocator().allocate_node();;
-        return new (new_cmd) handler_version_get(_completion_queue, _service);
+    void reject_request(const grpc::Status &status) override {
+        _stream.Finish(status, this);
+    }
+
+    void reset_call() override {
+        _stream.~ServerAsyncReaderWriter();
+        handler_base::reset_call();
+        new (&_stream) grpc::ServerAsyncReaderWriter<ServerPingResponse, ServerPingRequest>(&_ctx);
     }
+
 private:
-    static inline char _buffer[4096] = {};
-    static inline size_t _offset = 0;
+    void read_next_ping() {
+        _state = REQUEST_STATE_READ;
+        _stream.Read(_server_ping_request, this);
+    }
+
+    void finish(const grpc::Status &status) {
+        _state = REQUEST_STATE_COMPLETE;
+        _finished_at = server_metrics::clock::now();
+        _stream.Finish(status, this);
+    }
 
-    VersionGetRequest                                       *_version_get_request;
-    grpc::ServerAsyncResponseWriter<VersionGetResponse>     _responder;
+    ServerPingRequest                                                       *_server_ping_request;
+    grpc::ServerAsyncReaderWriter<ServerPingResponse, ServerPingRequest>    _stream;
 };
 
 #endif //GRPC_EXAMPLE_HANDLERS_H
@@ -0,0 +1,148 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_HISTOGRAM_H
+#define GRPC_EXAMPLE_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+// HDR style log-linear histogram: every power of two range is split into 64 linear sub buckets, so a recorded
+// value is off by less than 1/64 whatever its magnitude. Values are meant to be nanoseconds, anything above
+// ~18 minutes lands in the last bucket.
+//
+// A histogram has a single writer (record() is a plain load/store of the bucket) while any thread may read it
+// or merge it into another histogram at any time without stopping the writer.
+class latency_histogram {
+public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 7;
+    static constexpr uint64_t SUB_BUCKET_COUNT = 1ULL << SUB_BUCKET_BITS;
+    static constexpr uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static constexpr uint32_t MAX_VALUE_BITS = 40;
+    static constexpr uint64_t MAX_VALUE = (1ULL << MAX_VALUE_BITS) - 1;
+    static constexpr uint64_t BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_HALF + SUB_BUCKET_COUNT;
+
+    latency_histogram() {
+        reset();
+    }
+
+    latency_histogram(const latency_histogram &other) {
+        reset();
+        merge(other);
+    }
+
+    latency_histogram &operator=(const latency_histogram &other) {
+        if (this != &other) {
+            reset();
+            merge(other);
+        }
+        return *this;
+    }
+
+    void record(uint64_t value) {
+        value = std::min(value, MAX_VALUE);
+        increment(_counts[bucket_index(value)], 1);
+        increment(_count, 1);
+        increment(_sum, value);
+        if (value > _max.load(std::memory_order_relaxed)) {
+            _max.store(value, std::memory_order_relaxed);
+        }
+        if (value < _min.load(std::memory_order_relaxed)) {
+            _min.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    // Adds the other histogram's counts to this one, the caller must be the only writer of this histogram.
+    void merge(const latency_histogram &other) {
+        for (uint64_t i = 0; i < BUCKET_COUNT; ++i) {
+            auto count = other._counts[i].load(std::memory_order_relaxed);
+            if (count != 0) {
+                increment(_counts[i], count);
+            }
+        }
+        increment(_count, other._count.load(std::memory_order_relaxed));
+        increment(_sum, other._sum.load(std::memory_order_relaxed));
+        _max.store(std::max(_max.load(std::memory_order_relaxed), other._max.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+        _min.store(std::min(_min.load(std::memory_order_relaxed), other._min.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &count : _counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        _count.store(0, std::memory_order_relaxed);
+        _sum.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+        _min.store(UINT64_MAX, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    uint64_t min() const {
+        return count() ? _min.load(std::memory_order_relaxed) : 0;
+    }
+
+    double mean() const {
+        auto total = count();
+        return total ? static_cast<double>(_sum.load(std::memory_order_relaxed)) / total : 0.0;
+    }
+
+    // Value at the given percentile (0-100], reported as the highest value of the matching bucket.
+    uint64_t percentile(double percent) const {
+        uint64_t total = 0;
+        for (auto &count : _counts) {
+            total += count.load(std::memory_order_relaxed);
+        }
+        if (total == 0) {
+            return 0;
+        }
+        auto target = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(total) + 0.5);
+        target = std::max<uint64_t>(1, std::min(target, total));
+        uint64_t seen = 0;
+        for (uint64_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += _counts[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(highest_equivalent_value(i), max());
+            }
+        }
+        return max();
+    }
+
+    static uint64_t bucket_index(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return value;
+        }
+        uint32_t exponent = (63 - __builtin_clzll(value)) - (SUB_BUCKET_BITS - 1);
+        return exponent * SUB_BUCKET_HALF + (value >> exponent);
+    }
+
+    static uint64_t highest_equivalent_value(uint64_t index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+        uint64_t exponent = index / SUB_BUCKET_HALF - 1;
+        uint64_t sub_bucket = index - exponent * SUB_BUCKET_HALF;
+        return ((sub_bucket + 1) << exponent) - 1;
+    }
+
+private:
+    static void increment(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t>   _counts[BUCKET_COUNT];
+    std::atomic<uint64_t>   _count;
+    std::atomic<uint64_t>   _sum;
+    std::atomic<uint64_t>   _max;
+    std::atomic<uint64_t>   _min;
+};
+
+#endif //GRPC_EXAMPLE_HISTOGRAM_H
@@ -0,0 +1,282 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "load_generator.h"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace example::v1;
+
+const char *rpc_type_name(rpc_type_e type) {
+    switch (type) {
+        case RPC_TYPE_SERVER_PING:
+            return "ServerPing";
+        case RPC_TYPE_VERSION_GET:
+            return "VersionGet";
+        default:
+            return "Unknown";
+    }
+}
+
+std::shared_ptr<grpc::Channel> create_load_channel(const std::string &address, uint32_t channel_index) {
+    grpc::ChannelArguments args;
+    args.SetInt("grpc_example.channel_index", static_cast<int>(channel_index));
+    return grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+}
+
+void async_call::start(ExampleService::Stub &stub, grpc::CompletionQueue &completion_queue) {
+    if (type == RPC_TYPE_SERVER_PING) {
+        server_ping_reader = stub.AsyncServerPing(&ctx, server_ping_request, &completion_queue);
+        server_ping_reader->Finish(&server_ping_response, &status, this);
+    }
+    else {
+        version_get_reader = stub.AsyncVersionGet(&ctx, version_get_request, &completion_queue);
+        version_get_reader->Finish(&version_get_response, &status, this);
+    }
+}
+
+struct load_generator::worker {
+    std::shared_ptr<grpc::Channel>          channel;
+    std::unique_ptr<ExampleService::Stub>   stub;
+    grpc::CompletionQueue                   completion_queue;
+    uint32_t                                concurrency = 0;
+    double                                  qps = 0;
+    uint32_t                                outstanding = 0;
+    uint64_t                                sequence = 0;
+    std::minstd_rand                        random;
+    load_report                             report;
+};
+
+static std::chrono::system_clock::time_point to_deadline(load_generator::clock::time_point when) {
+    return std::chrono::system_clock::now() + std::chrono::duration_cast<std::chrono::system_clock::duration>(when - load_generator::clock::now());
+}
+
+void load_report::merge(const load_report &other) {
+    elapsed_sec = std::max(elapsed_sec, other.elapsed_sec);
+    for (int i = 0; i < RPC_TYPE_LAST; ++i) {
+        calls[i] += other.calls[i];
+        errors[i] += other.errors[i];
+        latency[i].merge(other.latency[i]);
+    }
+    for (size_t i = 0; i < sizeof(status_codes) / sizeof(status_codes[0]); ++i) {
+        status_codes[i] += other.status_codes[i];
+    }
+}
+
+uint64_t load_report::record(const async_call &call) {
+    auto latency_ns = call.latency_ns();
+    ++calls[call.type];
+    ++status_codes[call.status.error_code()];
+    if (call.status.ok()) {
+        latency[call.type].record(latency_ns);
+    }
+    else {
+        ++errors[call.type];
+    }
+    return latency_ns;
+}
+
+uint64_t load_report::total_calls() const {
+    uint64_t total = 0;
+    for (auto count : calls) {
+        total += count;
+    }
+    return total;
+}
+
+uint64_t load_report::total_errors() const {
+    uint64_t total = 0;
+    for (auto count : errors) {
+        total += count;
+    }
+    return total;
+}
+
+latency_histogram load_report::total_latency() const {
+    latency_histogram total;
+    for (auto &histogram : latency) {
+        total.merge(histogram);
+    }
+    return total;
+}
+
+void load_report::print(std::ostream &out) const {
+    auto all_calls = total_calls();
+    auto all_errors = total_errors();
+
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+    out << "Elapsed " << elapsed_sec << " sec, " << all_calls << " calls, " << all_errors << " errors, "
+        << (elapsed_sec > 0 ? all_calls / elapsed_sec : 0.0) << " calls/sec" << std::endl;
+    out << std::left << std::setw(12) << "rpc" << std::right << std::setw(12) << "calls" << std::setw(10) << "errors"
+        << std::setw(12) << "mean(us)" << std::setw(12) << "p50(us)" << std::setw(12) << "p99(us)"
+        << std::setw(12) << "p999(us)" << std::setw(12) << "max(us)" << std::endl;
+
+    auto print_row = [&](const char *name, uint64_t row_calls, uint64_t row_errors, const latency_histogram &histogram) {
+        out << std::left << std::setw(12) << name << std::right << std::setw(12) << row_calls << std::setw(10) << row_errors
+            << std::setw(12) << histogram.mean() / 1000.0 << std::setw(12) << histogram.percentile(50) / 1000.0
+            << std::setw(12) << histogram.percentile(99) / 1000.0 << std::setw(12) << histogram.percentile(99.9) / 1000.0
+            << std::setw(12) << histogram.max() / 1000.0 << std::endl;
+    };
+    for (int i = 0; i < RPC_TYPE_LAST; ++i) {
+        if (calls[i] != 0) {
+            print_row(rpc_type_name(static_cast<rpc_type_e>(i)), calls[i], errors[i], latency[i]);
+        }
+    }
+    print_row("all", all_calls, all_errors, total_latency());
+
+    for (size_t i = 1; i < sizeof(status_codes) / sizeof(status_codes[0]); ++i) {
+        if (status_codes[i] != 0) {
+            out << "status_code=" << i << ": " << status_codes[i] << " calls" << std::endl;
+        }
+    }
+    out.flags(flags);
+}
+
+void load_report::print_summary_header(std::ostream &out) {
+    out << std::right << std::setw(12) << "calls/sec" << std::setw(10) << "errors" << std::setw(12) << "p50(us)"
+        << std::setw(12) << "p99(us)" << std::setw(12) << "p999(us)" << "  " << "settings" << std::endl;
+}
+
+void load_report::print_summary(std::ostream &out, const std::string &label) const {
+    auto all_calls = total_calls();
+    auto histogram = total_latency();
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(1) << std::right
+        << std::setw(12) << (elapsed_sec > 0 ? all_calls / elapsed_sec : 0.0) << std::setw(10) << total_errors()
+        << std::setw(12) << histogram.percentile(50) / 1000.0 << std::setw(12) << histogram.percentile(99) / 1000.0
+        << std::setw(12) << histogram.percentile(99.9) / 1000.0 << "  " << label << std::endl;
+    out.flags(flags);
+}
+
+load_generator::load_generator(const load_options &options) : _options(options), _total_weight(0) {
+    _options.channels = std::max<uint32_t>(1, _options.channels);
+    _options.concurrency = std::max(_options.concurrency, _options.channels);
+    for (auto weight : _options.weights) {
+        _total_weight += weight;
+    }
+    if (_total_weight == 0) {
+        _options.weights[RPC_TYPE_SERVER_PING] = 1;
+        _total_weight = 1;
+    }
+}
+
+rpc_type_e load_generator::pick_rpc_type(worker &w) {
+    auto pick = w.random() % _total_weight;
+    for (int i = 0; i < RPC_TYPE_LAST; ++i) {
+        if (pick < _options.weights[i]) {
+            return static_cast<rpc_type_e>(i);
+        }
+        pick -= _options.weights[i];
+    }
+    return RPC_TYPE_SERVER_PING;
+}
+
+void load_generator::start_call(worker &w, clock::time_point scheduled) {
+    auto call = new async_call();
+    call->type = pick_rpc_type(w);
+    call->id = ++w.sequence;
+    call->scheduled = scheduled;
+    if (call->type == RPC_TYPE_SERVER_PING) {
+        call->server_ping_request.mutable_ping()->set_ping_generation(call->id);
+    }
+    ++w.outstanding;
+    call->start(*w.stub, w.completion_queue);
+}
+
+void load_generator::complete_call(worker &w, async_call *call) {
+    --w.outstanding;
+    w.report.record(*call);
+    delete call;
+}
+
+void load_generator::run_worker(worker &w, clock::time_point start, clock::time_point end) {
+    void *tag = nullptr;
+    bool ok = false;
+
+    if (w.qps <= 0) {
+        // Closed loop, every completion immediately makes room for the next call.
+        for (uint32_t i = 0; i < w.concurrency; ++i) {
+            start_call(w, clock::now());
+        }
+        while (w.outstanding > 0 && w.completion_queue.Next(&tag, &ok)) {
+            complete_call(w, static_cast<async_call *>(tag));
+            if (clock::now() < end) {
+                start_call(w, clock::now());
+            }
+        }
+    }
+    else {
+        // Open loop, calls are due on a fixed schedule whatever the server does, the in-flight cap only delays them.
+        auto interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / w.qps));
+        auto next_send = start;
+        while (true) {
+            auto now = clock::now();
+            while (w.outstanding < w.concurrency && next_send <= now && next_send < end) {
+                start_call(w, next_send);
+                next_send += interval;
+            }
+            bool sending = next_send < end;
+            if (!sending && w.outstanding == 0) {
+                break;
+            }
+
+            grpc::CompletionQueue::NextStatus status;
+            if (sending && w.outstanding < w.concurrency) {
+                status = w.completion_queue.AsyncNext(&tag, &ok, to_deadline(next_send));
+            }
+            else {
+                status = w.completion_queue.Next(&tag, &ok) ? grpc::CompletionQueue::GOT_EVENT : grpc::CompletionQueue::SHUTDOWN;
+            }
+            if (status == grpc::CompletionQueue::GOT_EVENT) {
+                complete_call(w, static_cast<async_call *>(tag));
+            }
+            else if (status == grpc::CompletionQueue::SHUTDOWN) {
+                break;
+            }
+        }
+    }
+
+    w.report.elapsed_sec = std::chrono::duration<double>(clock::now() - start).count();
+    w.completion_queue.Shutdown();
+    while (w.completion_queue.Next(&tag, &ok)) {
+        delete static_cast<async_call *>(tag);
+    }
+}
+
+load_report load_generator::run() {
+    std::vector<std::unique_ptr<worker>> workers;
+    for (uint32_t i = 0; i < _options.channels; ++i) {
+        auto w = std::make_unique<worker>();
+        w->channel = _options.channel_factory ? _options.channel_factory(i) : create_load_channel(_options.address, i);
+        w->stub = ExampleService::NewStub(w->channel);
+        w->concurrency = _options.concurrency / _options.channels + (i < _options.concurrency % _options.channels ? 1 : 0);
+        w->qps = _options.qps / _options.channels;
+        w->random.seed(i + 1);
+        w->sequence = static_cast<uint64_t>(i) << 48;
+        if (!_options.channel_factory && !w->channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5))) {
+            std::cout << "Failed connecting to " << _options.address << std::endl;
+            return load_report();
+        }
+        workers.emplace_back(std::move(w));
+    }
+
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(_options.duration_sec));
+    std::vector<std::thread> threads;
+    for (auto &w : workers) {
+        threads.emplace_back(&load_generator::run_worker, this, std::ref(*w), start, end);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    load_report report;
+    for (auto &w : workers) {
+        report.merge(w->report);
+    }
+    return report;
+}
@@ -0,0 +1,118 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_LOAD_GENERATOR_H
+#define GRPC_EXAMPLE_LOAD_GENERATOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "example/v1/example.grpc.pb.h"
+
+#include "histogram.h"
+
+enum rpc_type_e {
+    RPC_TYPE_SERVER_PING = 0,
+    RPC_TYPE_VERSION_GET = 1,
+    RPC_TYPE_LAST = 2
+};
+
+const char *rpc_type_name(rpc_type_e type);
+
+// Channels created for load get a distinct channel argument each, so gRPC gives every one its own connection.
+std::shared_ptr<grpc::Channel> create_load_channel(const std::string &address, uint32_t channel_index);
+
+// A single async unary call of either rpc type, the call itself is the completion queue tag.
+struct async_call {
+    using clock = std::chrono::steady_clock;
+    template <class R>
+    using reader_ptr = std::unique_ptr<grpc::ClientAsyncResponseReader<R>>;
+
+    rpc_type_e                                          type = RPC_TYPE_SERVER_PING;
+    uint64_t                                            id = 0;
+    // Latency is measured from this point.
+    clock::time_point                                   scheduled;
+    grpc::ClientContext                                 ctx;
+    grpc::Status                                        status;
+    example::v1::ServerPingRequest                      server_ping_request;
+    example::v1::ServerPingResponse                     server_ping_response;
+    reader_ptr<example::v1::ServerPingResponse>         server_ping_reader;
+    example::v1::VersionGetRequest                      version_get_request;
+    example::v1::VersionGetResponse                     version_get_response;
+    reader_ptr<example::v1::VersionGetResponse>         version_get_reader;
+
+    void start(example::v1::ExampleService::Stub &stub, grpc::CompletionQueue &completion_queue);
+
+    uint64_t latency_ns() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - scheduled).count();
+    }
+};
+
+struct load_options {
+    // Any gRPC target, "unix:/path" for a unix domain socket.
+    std::string     address = "127.0.0.1:6212";
+    // Replaces dialing address when set, e.g. for in-process channels to a server in the same process. Its channels
+    // are used as they are, without waiting for them to connect.
+    std::function<std::shared_ptr<grpc::Channel>(uint32_t channel_index)> channel_factory;
+    // Every channel gets its own connection, completion queue and thread.
+    uint32_t        channels = 1;
+    // Calls kept in flight across all channels (closed loop), or the cap on in-flight calls (open loop).
+    uint32_t        concurrency = 16;
+    // Target rate in calls/sec, 0 runs closed loop: a new call is sent as soon as one completes.
+    double          qps = 0;
+    double          duration_sec = 10;
+    // Relative weight of every rpc type in the generated traffic.
+    uint32_t        weights[RPC_TYPE_LAST] = {1, 0};
+};
+
+struct load_report {
+    double              elapsed_sec = 0;
+    uint64_t            calls[RPC_TYPE_LAST] = {};
+    uint64_t            errors[RPC_TYPE_LAST] = {};
+    // Indexed by grpc::StatusCode.
+    uint64_t            status_codes[grpc::StatusCode::UNAUTHENTICATED + 1] = {};
+    latency_histogram   latency[RPC_TYPE_LAST];
+
+    void merge(const load_report &other);
+    // Accounts a completed call, returns its latency.
+    uint64_t record(const async_call &call);
+    uint64_t total_calls() const;
+    uint64_t total_errors() const;
+    latency_histogram total_latency() const;
+    void print(std::ostream &out) const;
+    // A single line over all the rpcs, for comparing runs. The label goes last so the columns line up.
+    static void print_summary_header(std::ostream &out);
+    void print_summary(std::ostream &out, const std::string &label) const;
+};
+
+// Async completion-queue based client that drives the server with a configurable rpc mix. In open loop mode calls
+// are sent on a fixed schedule and latency is measured from the scheduled send time, so a stalled server shows up
+// in the percentiles instead of silently lowering the offered load.
+class load_generator {
+public:
+    explicit load_generator(const load_options &options);
+    load_report run();
+
+    using clock = std::chrono::steady_clock;
+
+private:
+    struct worker;
+
+    void run_worker(worker &w, clock::time_point start, clock::time_point end);
+    void start_call(worker &w, clock::time_point scheduled);
+    void complete_call(worker &w, async_call *call);
+    rpc_type_e pick_rpc_type(worker &w);
+
+    load_options    _options;
+    uint32_t        _total_weight;
+};
+
+#endif //GRPC_EXAMPLE_LOAD_GENERATOR_H
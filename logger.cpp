@@ -0,0 +1,179 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+using namespace std::chrono_literals;
+
+const char *log_level_name(log_level_e level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG:
+            return "debug";
+        case LOG_LEVEL_INFO:
+            return "info";
+        case LOG_LEVEL_WARNING:
+            return "warning";
+        case LOG_LEVEL_ERROR:
+            return "error";
+        case LOG_LEVEL_OFF:
+            return "off";
+        default:
+            return "unknown";
+    }
+}
+
+bool parse_log_level(const std::string &name, log_level_e &level) {
+    for (auto candidate : {LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARNING, LOG_LEVEL_ERROR, LOG_LEVEL_OFF}) {
+        if (name == log_level_name(candidate)) {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+logger::logger() : _level(LOG_LEVEL_INFO), _sample_rate(1), _ring(new record[RING_SIZE]), _tail(0), _head(0), _dropped(0), _running(true),
+                   _writer_idle(false) {
+    static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "logger::RING_SIZE must be a power of two");
+    for (uint64_t i = 0; i < RING_SIZE; ++i) {
+        _ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    _writer = std::thread(&logger::run_writer, this);
+}
+
+logger::~logger() {
+    {
+        std::lock_guard lk(_idle_mutex);
+        _running.store(false, std::memory_order_release);
+    }
+    _idle_cv.notify_one();
+    if (_writer.joinable()) {
+        _writer.join();
+    }
+}
+
+void logger::init(log_level_e level, uint32_t sample_rate) {
+    _level.store(level, std::memory_order_relaxed);
+    _sample_rate.store(std::max<uint32_t>(1, sample_rate), std::memory_order_relaxed);
+}
+
+void logger::write(log_level_e level, const char *message, size_t length) {
+    // Bounded MPSC ring: a slot is free for position pos when its sequence equals pos, and holds a message for the
+    // writer once its sequence is pos + 1.
+    auto pos = _tail.load(std::memory_order_relaxed);
+    record *slot = nullptr;
+    while (true) {
+        slot = &_ring[pos & (RING_SIZE - 1)];
+        auto sequence = slot->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<int64_t>(sequence - pos);
+        if (diff == 0) {
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->time = std::chrono::system_clock::now();
+    slot->length = static_cast<uint32_t>(std::min<size_t>(length, MESSAGE_SIZE));
+    ::memcpy(slot->message, message, slot->length);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in wait_for_messages(): either the writer sees this message before it goes to sleep, or
+    // this sees it idle and wakes it up.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_writer_idle.load(std::memory_order_relaxed)) {
+        std::lock_guard lk(_idle_mutex);
+        _idle_cv.notify_one();
+    }
+}
+
+void logger::flush() {
+    auto target = _tail.load(std::memory_order_acquire);
+    while (_head.load(std::memory_order_acquire) < target && _writer.joinable()) {
+        std::this_thread::sleep_for(1ms);
+    }
+}
+
+bool logger::write_pending(std::string &batch) {
+    static const char level_letters[] = {'D', 'I', 'W', 'E'};
+
+    auto head = _head.load(std::memory_order_relaxed);
+    while (true) {
+        auto &slot = _ring[head & (RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            break;
+        }
+
+        auto time = std::chrono::system_clock::to_time_t(slot.time);
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(slot.time.time_since_epoch()).count() % 1000000;
+        struct tm tm_time;
+        localtime_r(&time, &tm_time);
+        char prefix[48];
+        auto prefix_length = ::strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm_time);
+        prefix_length += ::snprintf(prefix + prefix_length, sizeof(prefix) - prefix_length, ".%06ld %c ", static_cast<long>(micros),
+                                    level_letters[std::min<int>(slot.level, LOG_LEVEL_ERROR)]);
+        batch.append(prefix, prefix_length);
+        batch.append(slot.message, slot.length);
+        batch.push_back('\n');
+
+        slot.sequence.store(head + RING_SIZE, std::memory_order_release);
+        ++head;
+    }
+    if (batch.empty()) {
+        return false;
+    }
+    std::cout.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+    std::cout.flush();
+    batch.clear();
+    _head.store(head, std::memory_order_release);
+    return true;
+}
+
+bool logger::has_pending() const {
+    auto head = _head.load(std::memory_order_relaxed);
+    return _ring[head & (RING_SIZE - 1)].sequence.load(std::memory_order_acquire) == head + 1;
+}
+
+void logger::wait_for_messages() {
+    std::unique_lock lk(_idle_mutex);
+    _writer_idle.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    _idle_cv.wait(lk, [this] { return has_pending() || !_running.load(std::memory_order_acquire); });
+    _writer_idle.store(false, std::memory_order_relaxed);
+}
+
+void logger::run_writer() {
+    std::string batch;
+    uint64_t reported_dropped = 0;
+    while (true) {
+        auto running = _running.load(std::memory_order_acquire);
+        auto wrote = write_pending(batch);
+
+        auto dropped = _dropped.load(std::memory_order_relaxed);
+        if (dropped != reported_dropped) {
+            std::cout << "logger: dropped " << dropped - reported_dropped << " message(s), the ring buffer was full" << std::endl;
+            reported_dropped = dropped;
+        }
+
+        if (!running) {
+            break;
+        }
+        if (!wrote) {
+            wait_for_messages();
+        }
+    }
+}
@@ -0,0 +1,144 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_LOGGER_H
+#define GRPC_EXAMPLE_LOGGER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+enum log_level_e {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,
+    LOG_LEVEL_WARNING = 2,
+    LOG_LEVEL_ERROR = 3,
+    LOG_LEVEL_OFF = 4
+};
+
+const char *log_level_name(log_level_e level);
+// Parses debug/info/warning/error/off, returns false on anything else.
+bool parse_log_level(const std::string &name, log_level_e &level);
+
+// Asynchronous logger: threads format their message into a slot of a lock-free ring buffer and go on, a background
+// thread writes the slots to stdout in batches. When the ring is full messages are dropped (and counted) rather than
+// making the caller wait, so logging never stalls a completion queue thread. An idle writer sleeps until a message
+// comes in.
+class logger {
+public:
+    static constexpr uint64_t RING_SIZE = 4096;
+    static constexpr uint64_t MESSAGE_SIZE = 224;
+
+    static logger &get_logger() {
+        static logger _logger;
+        return _logger;
+    }
+
+    ~logger();
+
+    // Messages below the level are skipped, of the sampled ones only every sample_rate-th (per thread) is kept.
+    void init(log_level_e level, uint32_t sample_rate);
+
+    bool enabled(log_level_e level) const {
+        return level >= _level.load(std::memory_order_relaxed);
+    }
+
+    bool sampled(log_level_e level) {
+        if (!enabled(level)) {
+            return false;
+        }
+        thread_local uint64_t _sample_counter = 0;
+        return _sample_counter++ % _sample_rate.load(std::memory_order_relaxed) == 0;
+    }
+
+    void write(log_level_e level, const char *message, size_t length);
+    // Waits until every message written so far reached stdout.
+    void flush();
+
+private:
+    struct alignas(64) record {
+        std::atomic<uint64_t>                   sequence;
+        log_level_e                             level;
+        uint32_t                                length;
+        std::chrono::system_clock::time_point   time;
+        char                                    message[MESSAGE_SIZE];
+    };
+
+    logger();
+    logger(const logger &other) = delete;
+
+    void run_writer();
+    bool write_pending(std::string &batch);
+    bool has_pending() const;
+    void wait_for_messages();
+
+    std::atomic<log_level_e>    _level;
+    std::atomic<uint32_t>       _sample_rate;
+    std::unique_ptr<record[]>   _ring;
+    alignas(64) std::atomic<uint64_t>   _tail;
+    alignas(64) std::atomic<uint64_t>   _head;
+    std::atomic<uint64_t>       _dropped;
+    std::atomic_bool            _running;
+    // Set while the writer waits for messages, write() wakes it up then.
+    std::atomic_bool            _writer_idle;
+    std::mutex                  _idle_mutex;
+    std::condition_variable     _idle_cv;
+    std::thread                 _writer;
+};
+
+// A message being formatted on the caller's stack, handed to the logger when the statement ends.
+class log_line {
+public:
+    explicit log_line(log_level_e level) : _level(level), _stream(&_buffer) {}
+
+    ~log_line() {
+        logger::get_logger().write(_level, _buffer.data(), _buffer.size());
+    }
+
+    std::ostream &stream() {
+        return _stream;
+    }
+
+private:
+    // Messages longer than the buffer are truncated.
+    class fixed_buffer : public std::streambuf {
+    public:
+        fixed_buffer() {
+            setp(_data, _data + sizeof(_data));
+        }
+        const char *data() const {
+            return pbase();
+        }
+        size_t size() const {
+            return pptr() - pbase();
+        }
+    private:
+        char _data[logger::MESSAGE_SIZE];
+    };
+
+    log_level_e     _level;
+    fixed_buffer    _buffer;
+    std::ostream    _stream;
+};
+
+struct log_voidify {
+    void operator&(std::ostream &) {}
+};
+
+// SERVER_LOG(INFO) << ...; the streamed expressions are only evaluated when the level is enabled.
+#define SERVER_LOG(level) \
+    !logger::get_logger().enabled(LOG_LEVEL_##level) ? (void)0 : log_voidify() & log_line(LOG_LEVEL_##level).stream()
+
+// Same as SERVER_LOG, for per-rpc messages: only one out of the configured sample rate is emitted.
+#define SERVER_LOG_SAMPLED(level) \
+    !logger::get_logger().sampled(LOG_LEVEL_##level) ? (void)0 : log_voidify() & log_line(LOG_LEVEL_##level).stream()
+
+#endif //GRPC_EXAMPLE_LOGGER_H
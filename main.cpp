@@ -1,22 +1,18 @@
 #include <iostream>
 #include <thread>
 #include <csignal>
+#include <cstring>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 #include "server.h"
 
 using std::cout;
 using std::endl;
 
-void term_signal_handler(int signum) {
-    cout << "Starting sigterm handler" << endl;
-    server::get_server().close_server();
-}
-
-void signal_handler(int signum, siginfo_t *siginfo, void *context) {
-	cout << "Interrupt signal " << signum << " received" << endl; 
-	if (signum == SIGTERM) {
-		term_signal_handler(signum);
-	}
+void fatal_signal_handler(int signum, siginfo_t *siginfo, void *context) {
+	cout << "Interrupt signal " << signum << " received" << endl;
 
 	// Reset to default behavior and re-raise signal
 	struct sigaction sa;
@@ -27,11 +23,20 @@ void signal_handler(int signum, siginfo_t *siginfo, void *context) {
 	raise(signum);
 }
 
+// Signals main() waits for on its signalfd, they are blocked in every thread so none of them runs a handler.
+sigset_t lifecycle_signals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int signum : { SIGINT, SIGTERM, SIGQUIT, SIGUSR1 }) {
+        sigaddset(&signals, signum);
+    }
+    return signals;
+}
+
 void register_signals() {
-    struct sigaction sa;
-    sa.sa_sigaction = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_SIGINFO;
+    // Must run before any thread is started, threads inherit the blocked signals.
+    auto signals = lifecycle_signals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
     // Ignore SIGPIPE
     struct sigaction ignore_sa;
@@ -40,18 +45,62 @@ void register_signals() {
     ignore_sa.sa_flags = 0;
     sigaction(SIGPIPE, &ignore_sa, nullptr);
 
-    std::vector<int> signals_to_handle = { SIGINT, SIGTERM, SIGQUIT, SIGABRT, SIGSEGV, SIGFPE, SIGILL, SIGBUS, SIGSYS, SIGSTOP, SIGUSR1 };
+    // Faults can't wait for the main thread, these are reported and re-raised in place.
+    struct sigaction sa;
+    sa.sa_sigaction = fatal_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    std::vector<int> signals_to_handle = { SIGABRT, SIGSEGV, SIGFPE, SIGILL, SIGBUS, SIGSYS };
     for (int signum : signals_to_handle) {
         sigaction(signum, &sa, nullptr);
     }
 }
 
+// Blocks until a termination signal arrives, SIGUSR1 prints the server metrics meanwhile.
+void wait_for_termination() {
+    auto signals = lifecycle_signals();
+    int fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (fd < 0) {
+        cout << "signalfd failed, error=" << strerror(errno) << ", falling back to sigwait" << endl;
+    }
+
+    while (true) {
+        int signum = 0;
+        if (fd >= 0) {
+            signalfd_siginfo info;
+            auto ret = read(fd, &info, sizeof(info));
+            if (ret != sizeof(info)) {
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                cout << "Failed reading the signalfd, error=" << strerror(errno) << endl;
+                break;
+            }
+            signum = static_cast<int>(info.ssi_signo);
+        }
+        else if (sigwait(&signals, &signum) != 0) {
+            break;
+        }
+
+        if (signum == SIGUSR1) {
+            server::get_server().print_metrics();
+            continue;
+        }
+        cout << "Interrupt signal " << signum << " received, shutting down" << endl;
+        break;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
 int main() {
     register_signals();
-    server::get_server().init_server();
-    while (true) {
-	    std::this_thread::yield();
+    if (!server::get_server().init_server()) {
+        return 1;
     }
+    wait_for_termination();
     server::get_server().close_server();
     return 0;
 }
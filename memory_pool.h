@@ -2,34 +2,31 @@
 #ifndef GRPC_EXAMPLE_MEMORY_POOL_H
 #define GRPC_EXAMPLE_MEMORY_POOL_H
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
 
 using std::cout;
 using std::endl;
 
-class memory_allocator {
-public:
-    static void* allocate(char *buffer, size_t &offset, size_t alloc_size, size_t max_size) {
-        if (offset + alloc_size > max_size) {
-            return nullptr; // Not enough space
-        }
-        void *ptr = buffer + offset;
-        offset += alloc_size;
-        return ptr;
-    }
-
-    static void dealloc(void *ptr, size_t &offset, size_t dealloc_size) {
-        // Do nothing
-    }
-
-    static void reset(size_t &offset, char buffer[], size_t size) {
-        offset = 0;
-        ::memset(buffer, 0x20, size);
-    }
+enum mem_pool_mode_e {
+    // Free/allocated node lists guarded by mutexes.
+    MEM_POOL_MODE_LOCKED = 0,
+    // Index based lock-free free list (tagged head, ABA safe) with per-thread magazines in front of it. The nodes live
+    // in slabs of an mmap'ed range, slabs are added when the pool runs dry and given back to the OS by trim().
+    MEM_POOL_MODE_LOCK_FREE = 1,
 };
 
 class mem_pool{
@@ -105,23 +102,37 @@ public:
         uint64_t index;
     };
 
-    mem_pool() : _mutex(), _count(0), _size(0), _allocated(nullptr), _free_list(), _allocated_list(), _did_init(false), _name("unnamed_pool") {}
+    mem_pool() : _mutex(), _count(0), _size(0), _allocated(nullptr), _nodes(nullptr), _free_list(), _allocated_list(), _did_init(false), _name("unnamed_pool"),
+                 _mode(MEM_POOL_MODE_LOCKED), _pool_id(0), _free_head(INVALID_INDEX), _next(nullptr), _states(nullptr), _magazine_size(0),
+                 _capacity(0), _slab_slots(0), _slab_bytes(0), _initial_slabs(0), _slab_count(0), _slab_status(nullptr), _mapped_bytes(0), _huge_pages(false) {}
 
-    void init(uint64_t size, uint64_t count, const std::string& name){
+    // count nodes are available right away. In lock-free mode the pool grows on demand up to max_count nodes (0 means
+    // count), huge_pages backs the slabs with MAP_HUGETLB pages when the system has them reserved, with transparent
+    // huge pages otherwise.
+    void init(uint64_t size, uint64_t count, const std::string& name, mem_pool_mode_e mode = MEM_POOL_MODE_LOCKED, uint64_t max_count = 0, bool huge_pages = false){
         std::unique_lock<std::mutex> g(_mutex);
         if(_did_init) {
             return;
         }
         _size = size;
         _count = count;
-        _allocated = (char*)malloc(count * size);
-        _nodes = new mem_node[count];
+        _capacity = count;
+        _mode = mode;
 
-        for (int i = 0 ; i < count ; i ++){
-            _nodes[i].index = i;
-            _nodes[i].next = nullptr;
-            _nodes[i].prev = nullptr;
-            _free_list.push_back(_nodes+i);
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            if (!init_lock_free(std::max(count, max_count), huge_pages)) {
+                return;
+            }
+        }
+        else {
+            _allocated = (char*)malloc(count * size);
+            _nodes = new mem_node[count];
+            for (int i = 0 ; i < count ; i ++){
+                _nodes[i].index = i;
+                _nodes[i].next = nullptr;
+                _nodes[i].prev = nullptr;
+                _free_list.push_back(_nodes+i);
+            }
         }
 
         if (!name.empty()) {
@@ -131,6 +142,10 @@ public:
     }
 
     char* allocate_node(){
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            return allocate_node_lock_free();
+        }
+
         std::unique_lock<std::mutex> g(_mutex);
         if (_free_list.head == nullptr){
             return nullptr;
@@ -142,6 +157,10 @@ public:
     }
 
     bool deallocate_node(char* ptr){
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            return deallocate_node_lock_free(ptr);
+        }
+
         std::unique_lock<std::mutex> g(_mutex);
         uint64_t index = (ptr - _allocated) / _size;
         if (_nodes[index].lst == &_allocated_list){
@@ -154,23 +173,558 @@ public:
         }
     }
 
+    // Number of nodes currently handed out, nodes cached in thread magazines count as free.
+    uint64_t allocated_count() {
+        if (!_did_init) {
+            return 0;
+        }
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            uint64_t allocated = 0;
+            for (uint64_t i = 0; i < _capacity; ++i) {
+                allocated += (_states[i].load(std::memory_order_relaxed) == NODE_STATE_ALLOCATED);
+            }
+            return allocated;
+        }
+        std::unique_lock<std::mutex> g(_mutex);
+        return _allocated_list.size;
+    }
+
+    // Nodes ready to be handed out without growing the pool, including the ones cached in thread magazines.
+    uint64_t free_count() {
+        if (!_did_init) {
+            return 0;
+        }
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            uint64_t free = 0;
+            for (uint64_t i = 0; i < _capacity; ++i) {
+                free += (_states[i].load(std::memory_order_relaxed) == NODE_STATE_FREE);
+            }
+            return free;
+        }
+        std::unique_lock<std::mutex> g(_mutex);
+        return _free_list.size;
+    }
+
+    // Nodes the pool can hold once fully grown, and the memory it currently has committed to slabs.
+    uint64_t capacity() const {
+        return _did_init ? _capacity : 0;
+    }
+
+    uint64_t committed_bytes() const {
+        if (!_did_init) {
+            return 0;
+        }
+        if (_mode != MEM_POOL_MODE_LOCK_FREE) {
+            return _count * _size;
+        }
+        uint64_t active = 0;
+        for (uint64_t i = 0; i < _slab_count; ++i) {
+            active += (_slab_status[i].load(std::memory_order_relaxed) != SLAB_STATUS_RELEASED);
+        }
+        return active * _slab_bytes;
+    }
+
+    const std::string &name() const {
+        return _name;
+    }
+
+    // Slots are rounded up to a cache line in lock-free mode.
+    uint64_t node_size() const {
+        return _size;
+    }
+
+    // Lock-free mode only: once the nodes in use have fitted in one slab less for the whole quiet period, the last
+    // slab is parked and given back to the OS when none of its nodes is in use anymore. The slabs the pool started
+    // with are kept. Meant to be called periodically from a single housekeeping thread.
+    void trim(std::chrono::steady_clock::duration quiet_period) {
+        if (_mode != MEM_POOL_MODE_LOCK_FREE || !_did_init) {
+            return;
+        }
+        std::lock_guard lk(_grow_mutex);
+        auto now = std::chrono::steady_clock::now();
+        uint64_t allocated = 0;
+        uint64_t active = 0;
+        uint64_t last_active = 0;
+        bool parking = false;
+        // Only while a parking slab still has free nodes, some of them may be on the shared free list.
+        bool drain = false;
+        for (uint64_t s = 0; s < _slab_count; ++s) {
+            auto status = _slab_status[s].load(std::memory_order_relaxed);
+            if (status == SLAB_STATUS_ACTIVE) {
+                revive_parked_nodes(s);
+                allocated += slab_allocated_nodes(s);
+                ++active;
+                last_active = s;
+            }
+            else if (status == SLAB_STATUS_PARKING) {
+                parking = true;
+                drain = drain || slab_has_free_nodes(s);
+            }
+        }
+
+        // Half a slab of headroom, so a steady load doesn't park and revive a slab over and over.
+        auto spare = last_active >= _initial_slabs && allocated + _slab_slots / 2 <= (active - 1) * _slab_slots;
+        if (!spare) {
+            _spare_since = std::chrono::steady_clock::time_point();
+        }
+        else if (_spare_since == std::chrono::steady_clock::time_point()) {
+            _spare_since = now;
+        }
+        else if (now - _spare_since >= quiet_period) {
+            _slab_status[last_active].store(SLAB_STATUS_PARKING, std::memory_order_relaxed);
+            _spare_since = std::chrono::steady_clock::time_point();
+            parking = true;
+            drain = true;
+        }
+        if (!parking) {
+            return;
+        }
+
+        // Take the parking slabs' nodes out of the shared free list, the ones cached in magazines are parked by the
+        // thread that allocates them next and the ones in use when they are deallocated.
+        if (drain) {
+            park_free_list_nodes();
+        }
+
+        for (uint64_t s = _initial_slabs; s < _slab_count; ++s) {
+            if (_slab_status[s].load(std::memory_order_relaxed) == SLAB_STATUS_PARKING && slab_fully_parked(s)) {
+                release_slab(s);
+            }
+        }
+    }
+
+    // Whether ptr is a node of a slab being given back to the OS. Long lived users of the pool move their data out
+    // of such nodes when they get the chance (deallocate, allocate again), or the slab stays.
+    bool in_parking_slab(const char *ptr) const {
+        if (_mode != MEM_POOL_MODE_LOCK_FREE) {
+            return false;
+        }
+        auto index = node_index(ptr);
+        return index != INVALID_INDEX && slab_status(index) == SLAB_STATUS_PARKING;
+    }
+
     void close(){
         std::unique_lock<std::mutex> g(_mutex);
         if (!_did_init){
             return;
         }
 
-        _free_list.clear();
-        _allocated_list.clear();
+        if (_mode == MEM_POOL_MODE_LOCK_FREE) {
+            close_lock_free();
+        }
+        else {
+            _free_list.clear();
+            _allocated_list.clear();
+            delete[] _nodes;
+            _nodes = nullptr;
+            free(_allocated);
+        }
 
-        free(_allocated);
-        delete[] _nodes;
         _allocated = nullptr;
-        _nodes = nullptr;
         _did_init = false;
     }
 
 protected:
+    static constexpr uint32_t INVALID_INDEX = UINT32_MAX;
+    static constexpr uint32_t MAX_MAGAZINE_SIZE = 32;
+    static constexpr uint32_t MAX_THREAD_MAGAZINES = 16;
+    // Slabs are sized and aligned for a 2MB huge page, slots are cache line aligned.
+    static constexpr uint64_t SLAB_BYTES = 2 * 1024 * 1024;
+    static constexpr uint64_t CACHE_LINE_SIZE = 64;
+
+    enum node_state_e : uint8_t {
+        NODE_STATE_FREE = 0,
+        NODE_STATE_ALLOCATED = 1,
+        // Out of circulation: its slab is being (or has been) given back to the OS.
+        NODE_STATE_PARKED = 2,
+    };
+
+    // A slab is released only once every one of its nodes is parked. A parking slab's nodes are parked by whoever
+    // holds them next: allocators that pop them, deallocate_node and trim() (which unlinks them from the shared free list).
+    enum slab_status_e : uint8_t {
+        SLAB_STATUS_RELEASED = 0,
+        SLAB_STATUS_ACTIVE = 1,
+        SLAB_STATUS_PARKING = 2,
+    };
+
+
+    // Small per-thread stack of free indexes, allocations and frees hit it before touching the shared free list.
+    struct magazine {
+        uint64_t pool_id = 0;
+        uint32_t count = 0;
+        uint32_t items[MAX_MAGAZINE_SIZE];
+    };
+
+    // The magazines of a single thread, whatever they still hold goes back to the (still alive) pools when the thread exits.
+    struct thread_magazines {
+        magazine magazines[MAX_THREAD_MAGAZINES];
+
+        ~thread_magazines() {
+            for (auto &mag : magazines) {
+                flush_to_owner(mag);
+            }
+        }
+    };
+
+    static std::mutex &registry_mutex() {
+        static std::mutex the_mutex;
+        return the_mutex;
+    }
+
+    static std::unordered_map<uint64_t, mem_pool *> &registry() {
+        static std::unordered_map<uint64_t, mem_pool *> the_registry;
+        return the_registry;
+    }
+
+    static thread_magazines &local_magazines() {
+        static thread_local thread_magazines the_magazines;
+        return the_magazines;
+    }
+
+    // Returns the magazine's content to its pool, if the pool was closed in the meantime the indexes are just dropped.
+    static void flush_to_owner(magazine &mag) {
+        if (mag.count != 0) {
+            std::lock_guard lk(registry_mutex());
+            auto it = registry().find(mag.pool_id);
+            if (it != registry().end()) {
+                it->second->push_free_indexes(mag.items, mag.count);
+            }
+        }
+        mag.count = 0;
+        mag.pool_id = 0;
+    }
+
+    static uint64_t pack_head(uint64_t old_head, uint32_t index) {
+        return (((old_head >> 32) + 1) << 32) | index;
+    }
+
+    bool init_lock_free(uint64_t max_count, bool huge_pages) {
+        static std::atomic<uint64_t> next_pool_id{1};
+        _size = (_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        if (_size <= SLAB_BYTES) {
+            _slab_slots = SLAB_BYTES / _size;
+            _slab_bytes = SLAB_BYTES;
+        }
+        else {
+            _slab_slots = 1;
+            _slab_bytes = (_size + SLAB_BYTES - 1) / SLAB_BYTES * SLAB_BYTES;
+        }
+        _initial_slabs = std::max<uint64_t>(1, (_count + _slab_slots - 1) / _slab_slots);
+        _slab_count = std::max(_initial_slabs, (max_count + _slab_slots - 1) / _slab_slots);
+        _capacity = _slab_count * _slab_slots;
+
+        // The whole range is reserved up front so a node's address never moves and its index is plain arithmetic,
+        // memory is only committed as the slabs' pages are touched.
+        _mapped_bytes = _slab_count * _slab_bytes;
+        _huge_pages = huge_pages;
+        void *memory = MAP_FAILED;
+        if (huge_pages) {
+            memory = ::mmap(nullptr, _mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+        }
+        if (memory == MAP_FAILED) {
+            _huge_pages = false;
+            memory = ::mmap(nullptr, _mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (memory != MAP_FAILED && huge_pages) {
+                ::madvise(memory, _mapped_bytes, MADV_HUGEPAGE);
+            }
+        }
+        if (memory == MAP_FAILED) {
+            cout << "mem_pool " << _name << " failed reserving " << _mapped_bytes << " bytes" << endl;
+            _mapped_bytes = 0;
+            return false;
+        }
+        _allocated = static_cast<char *>(memory);
+
+        _pool_id = next_pool_id.fetch_add(1);
+        _next = new std::atomic<uint32_t>[_capacity];
+        _states = new std::atomic<uint8_t>[_capacity];
+        _slab_status = new std::atomic<uint8_t>[_slab_count];
+        // Keep magazines small relative to the pool so that cached indexes can't starve the other threads. Sized from
+        // the initial slabs rather than the requested count: pools of a few handlers still fill a whole slab.
+        _magazine_size = std::min<uint64_t>(MAX_MAGAZINE_SIZE, _initial_slabs * _slab_slots / 16);
+
+        for (uint64_t i = 0; i < _capacity; ++i) {
+            _next[i].store(INVALID_INDEX, std::memory_order_relaxed);
+            _states[i].store(NODE_STATE_PARKED, std::memory_order_relaxed);
+        }
+        for (uint64_t s = 0; s < _slab_count; ++s) {
+            _slab_status[s].store(SLAB_STATUS_RELEASED, std::memory_order_relaxed);
+        }
+        _free_head.store(pack_head(0, INVALID_INDEX), std::memory_order_release);
+        for (uint64_t s = 0; s < _initial_slabs; ++s) {
+            activate_slab(s);
+        }
+
+        std::lock_guard lk(registry_mutex());
+        registry()[_pool_id] = this;
+        return true;
+    }
+
+    void close_lock_free() {
+        {
+            std::lock_guard lk(registry_mutex());
+            registry().erase(_pool_id);
+        }
+        ::munmap(_allocated, _mapped_bytes);
+        _mapped_bytes = 0;
+        delete[] _next;
+        delete[] _states;
+        delete[] _slab_status;
+        _next = nullptr;
+        _states = nullptr;
+        _slab_status = nullptr;
+        _free_head.store(pack_head(0, INVALID_INDEX));
+    }
+
+    char *node_address(uint32_t index) const {
+        return _allocated + (index / _slab_slots) * _slab_bytes + (index % _slab_slots) * _size;
+    }
+
+    // The node index of ptr, or INVALID_INDEX if ptr isn't the start of a node of this pool.
+    uint32_t node_index(const char *ptr) const {
+        if (ptr < _allocated || ptr >= _allocated + _mapped_bytes) {
+            return INVALID_INDEX;
+        }
+        auto offset = static_cast<uint64_t>(ptr - _allocated);
+        auto slot = (offset % _slab_bytes) / _size;
+        if (slot >= _slab_slots || (offset % _slab_bytes) % _size != 0) {
+            return INVALID_INDEX;
+        }
+        return static_cast<uint32_t>((offset / _slab_bytes) * _slab_slots + slot);
+    }
+
+    uint8_t slab_status(uint32_t index) const {
+        return _slab_status[index / _slab_slots].load(std::memory_order_relaxed);
+    }
+
+    // Puts a released slab's nodes (all parked) on the free list. Called with _grow_mutex held, or from init.
+    void activate_slab(uint64_t s) {
+        std::vector<uint32_t> indexes(_slab_slots);
+        for (uint64_t i = 0; i < _slab_slots; ++i) {
+            indexes[i] = static_cast<uint32_t>(s * _slab_slots + i);
+            _states[indexes[i]].store(NODE_STATE_FREE, std::memory_order_relaxed);
+        }
+        _slab_status[s].store(SLAB_STATUS_ACTIVE, std::memory_order_release);
+        push_free_indexes(indexes.data(), static_cast<uint32_t>(indexes.size()));
+    }
+
+    void release_slab(uint64_t s) {
+        _slab_status[s].store(SLAB_STATUS_RELEASED, std::memory_order_relaxed);
+        auto *slab = _allocated + s * _slab_bytes;
+        if (::madvise(slab, _slab_bytes, MADV_DONTNEED) == 0) {
+            return;
+        }
+        // Kernels before 5.18 refuse MADV_DONTNEED on MAP_HUGETLB mappings, the slab is then mapped anew in place,
+        // which drops its pages just the same.
+        auto flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED | (_huge_pages ? MAP_HUGETLB : 0);
+        if (::mmap(slab, _slab_bytes, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+            cout << "mem_pool " << _name << " failed giving slab " << s << " back to the OS, its memory stays committed" << endl;
+        }
+    }
+
+    // Parks a node its caller owns (popped from a free list) if its slab is parking.
+    bool park_if_parking(uint32_t index) {
+        if (slab_status(index) != SLAB_STATUS_PARKING) {
+            return false;
+        }
+        _states[index].store(NODE_STATE_PARKED, std::memory_order_relaxed);
+        return true;
+    }
+
+    // An allocation racing with grow() may park a node just after its slab was made active again, those nodes are
+    // put back in circulation here.
+    void revive_parked_nodes(uint64_t s) {
+        std::vector<uint32_t> revived;
+        for (uint64_t i = 0; i < _slab_slots; ++i) {
+            auto index = static_cast<uint32_t>(s * _slab_slots + i);
+            uint8_t expected = NODE_STATE_PARKED;
+            if (_states[index].compare_exchange_strong(expected, NODE_STATE_FREE, std::memory_order_relaxed)) {
+                revived.push_back(index);
+            }
+        }
+        push_free_indexes(revived.data(), static_cast<uint32_t>(revived.size()));
+    }
+
+    uint64_t slab_allocated_nodes(uint64_t s) const {
+        uint64_t allocated = 0;
+        for (uint64_t i = s * _slab_slots; i < (s + 1) * _slab_slots; ++i) {
+            allocated += (_states[i].load(std::memory_order_relaxed) == NODE_STATE_ALLOCATED);
+        }
+        return allocated;
+    }
+
+    bool slab_has_free_nodes(uint64_t s) const {
+        for (uint64_t i = s * _slab_slots; i < (s + 1) * _slab_slots; ++i) {
+            if (_states[i].load(std::memory_order_relaxed) == NODE_STATE_FREE) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool slab_fully_parked(uint64_t s) const {
+        for (uint64_t i = s * _slab_slots; i < (s + 1) * _slab_slots; ++i) {
+            if (_states[i].load(std::memory_order_relaxed) != NODE_STATE_PARKED) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Slow path of an allocation that found the pool empty: a parking slab is put back to use first, a released one
+    // is activated otherwise.
+    uint32_t grow() {
+        std::lock_guard lk(_grow_mutex);
+        auto index = pop_free_index();
+        if (index != INVALID_INDEX) {
+            return index;
+        }
+        for (uint64_t s = _initial_slabs; s < _slab_count; ++s) {
+            if (_slab_status[s].load(std::memory_order_relaxed) == SLAB_STATUS_PARKING) {
+                _slab_status[s].store(SLAB_STATUS_ACTIVE, std::memory_order_relaxed);
+                revive_parked_nodes(s);
+                return pop_free_index();
+            }
+        }
+        for (uint64_t s = _initial_slabs; s < _slab_count; ++s) {
+            if (_slab_status[s].load(std::memory_order_relaxed) == SLAB_STATUS_RELEASED) {
+                activate_slab(s);
+                return pop_free_index();
+            }
+        }
+        return INVALID_INDEX;
+    }
+
+    magazine *local_magazine() {
+        if (_magazine_size == 0) {
+            return nullptr;
+        }
+        auto &mag = local_magazines().magazines[_pool_id % MAX_THREAD_MAGAZINES];
+        if (mag.pool_id != _pool_id) {
+            // The slot belonged to another pool, hand its indexes back before taking it over.
+            flush_to_owner(mag);
+            mag.pool_id = _pool_id;
+        }
+        return &mag;
+    }
+
+    uint32_t pop_free_index() {
+        auto head = _free_head.load(std::memory_order_acquire);
+        while (true) {
+            auto index = static_cast<uint32_t>(head);
+            if (index == INVALID_INDEX) {
+                return INVALID_INDEX;
+            }
+            // The next link may be stale if another thread popped the node meanwhile, the tag makes the CAS fail then.
+            auto next = _next[index].load(std::memory_order_relaxed);
+            if (_free_head.compare_exchange_weak(head, pack_head(head, next), std::memory_order_acquire, std::memory_order_acquire)) {
+                return index;
+            }
+        }
+    }
+
+    // Pushes a batch of indexes with a single CAS, the indexes are chained to each other first.
+    void push_free_indexes(const uint32_t *indexes, uint32_t count) {
+        if (count == 0) {
+            return;
+        }
+        for (uint32_t i = 0; i + 1 < count; ++i) {
+            _next[indexes[i]].store(indexes[i + 1], std::memory_order_relaxed);
+        }
+        auto last = indexes[count - 1];
+        auto head = _free_head.load(std::memory_order_relaxed);
+        do {
+            _next[last].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        } while (!_free_head.compare_exchange_weak(head, pack_head(head, indexes[0]), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Unlinks the nodes of parking slabs from the shared free list and parks them. The list is taken with a single CAS
+    // and walked privately, the nodes that stay are relinked in place and put back with one more CAS. The list is only
+    // empty for the walk, allocations that find it empty meanwhile wait in grow() for just that long.
+    void park_free_list_nodes() {
+        auto head = _free_head.load(std::memory_order_acquire);
+        while (static_cast<uint32_t>(head) != INVALID_INDEX &&
+               !_free_head.compare_exchange_weak(head, pack_head(head, INVALID_INDEX), std::memory_order_acquire, std::memory_order_acquire)) {
+        }
+        auto first = INVALID_INDEX;
+        auto last = INVALID_INDEX;
+        for (auto index = static_cast<uint32_t>(head); index != INVALID_INDEX;) {
+            auto next = _next[index].load(std::memory_order_relaxed);
+            if (!park_if_parking(index)) {
+                if (last == INVALID_INDEX) {
+                    first = index;
+                }
+                else {
+                    _next[last].store(index, std::memory_order_relaxed);
+                }
+                last = index;
+            }
+            index = next;
+        }
+        if (first == INVALID_INDEX) {
+            return;
+        }
+        auto current = _free_head.load(std::memory_order_relaxed);
+        do {
+            _next[last].store(static_cast<uint32_t>(current), std::memory_order_relaxed);
+        } while (!_free_head.compare_exchange_weak(current, pack_head(current, first), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    char *allocate_node_lock_free() {
+        auto mag = local_magazine();
+        while (true) {
+            uint32_t index = INVALID_INDEX;
+            if (mag && mag->count > 0) {
+                index = mag->items[--mag->count];
+            }
+            else {
+                index = pop_free_index();
+                if (index == INVALID_INDEX) {
+                    index = grow();
+                    if (index == INVALID_INDEX) {
+                        return nullptr;
+                    }
+                }
+            }
+            if (park_if_parking(index)) {
+                continue;
+            }
+            _states[index].store(NODE_STATE_ALLOCATED, std::memory_order_relaxed);
+            return node_address(index);
+        }
+    }
+
+    bool deallocate_node_lock_free(char *ptr) {
+        auto index = node_index(ptr);
+        if (index == INVALID_INDEX) {
+            return false;
+        }
+        uint8_t expected = NODE_STATE_ALLOCATED;
+        auto parking = slab_status(index) == SLAB_STATUS_PARKING;
+        if (!_states[index].compare_exchange_strong(expected, parking ? NODE_STATE_PARKED : NODE_STATE_FREE, std::memory_order_relaxed)) {
+            // not allocated
+            return false;
+        }
+        if (parking) {
+            return true;
+        }
+
+        auto mag = local_magazine();
+        if (mag == nullptr) {
+            push_free_indexes(&index, 1);
+            return true;
+        }
+        if (mag->count == _magazine_size) {
+            // Full magazine, move its older half to the shared list in one go.
+            auto half = std::max<uint32_t>(1, _magazine_size / 2);
+            push_free_indexes(mag->items, half);
+            ::memmove(mag->items, mag->items + half, (mag->count - half) * sizeof(uint32_t));
+            mag->count -= half;
+        }
+        mag->items[mag->count++] = index;
+        return true;
+    }
+
     bool _did_init;
     std::string _name;
     char* _allocated;
@@ -180,30 +734,138 @@ protected:
     uint64_t _size;
     uint64_t _count;
     std::mutex _mutex;
+
+    mem_pool_mode_e _mode;
+    uint64_t _pool_id;
+    std::atomic<uint64_t> _free_head;
+    std::atomic<uint32_t>* _next;
+    std::atomic<uint8_t>* _states;
+    uint64_t _magazine_size;
+
+    uint64_t _capacity;
+    uint64_t _slab_slots;
+    uint64_t _slab_bytes;
+    uint64_t _initial_slabs;
+    uint64_t _slab_count;
+    std::atomic<uint8_t>* _slab_status;
+    // Since when the nodes in use fit in one slab less, written by trim() only.
+    std::chrono::steady_clock::time_point _spare_since;
+    uint64_t _mapped_bytes;
+    bool _huge_pages;
+    std::mutex _grow_mutex;
 };
 
+// Handlers come from one lock-free mem_pool per handler type, so every type has its own free list and its slots are
+// sized to the type's size class instead of to the largest handler. The size class and the checks that a type fits a
+// slot are resolved at compile time.
 class handlers_pool {
 public:
+    // Slots are cache line aligned, a handler can't ask for more than that.
+    static constexpr uint64_t SLOT_ALIGNMENT = 64;
+    // A handler carries the initial block of its arena, one larger than this is a mistake rather than a new class.
+    static constexpr uint64_t MAX_SLOT_SIZE = 16384;
+
+    // Sizes are rounded up to a quarter of their power of two (and to a cache line), so slots waste at most a quarter
+    // of a handler and a handler that grows by a few bytes usually stays in its class.
+    static constexpr uint64_t size_class(uint64_t size) {
+        uint64_t power = SLOT_ALIGNMENT;
+        while (power * 2 <= size) {
+            power *= 2;
+        }
+        auto step = std::max(power / 4, SLOT_ALIGNMENT);
+        return (size + step - 1) / step * step;
+    }
+
+    template <class T>
+    static constexpr uint64_t slot_size() {
+        static_assert(alignof(T) <= SLOT_ALIGNMENT, "handler type needs a stricter alignment than handlers_pool slots have");
+        static_assert(size_class(sizeof(T)) <= MAX_SLOT_SIZE, "handler type doesn't fit the largest handlers_pool slot");
+        return size_class(sizeof(T));
+    }
+
     static handlers_pool &get_pool() {
         static handlers_pool the_pool;
         return the_pool;
     }
 
-    mem_pool &allocator() {
-        return *_pool;
+    // The pool T's slots come from, created the first time T is used.
+    template <class T>
+    mem_pool &type_pool() {
+        static mem_pool &the_pool = add_pool();
+        return the_pool;
     }
 
-private:
-    handlers_pool() {
-        _pool = new mem_pool();
-        _pool->init(2048, 100, "handlers");
+    // Sized by the server before posting the handlers of type T: count handlers it keeps armed, and up to max_count
+    // once the handler groups grow under load.
+    template <class T>
+    void init(const std::string &name, uint64_t count, uint64_t max_count, bool huge_pages) {
+        type_pool<T>().init(slot_size<T>(), count, name, MEM_POOL_MODE_LOCK_FREE, max_count, huge_pages);
+    }
+
+    // A slot for a T, nullptr once T's pool is exhausted.
+    template <class T>
+    void *allocate() {
+        return type_pool<T>().allocate_node();
     }
+
+    // Totals over every handler type.
+    uint64_t allocated_count() {
+        uint64_t allocated = 0;
+        for_each_pool([&allocated](mem_pool &pool) { allocated += pool.allocated_count(); });
+        return allocated;
+    }
+
+    uint64_t capacity() {
+        uint64_t capacity = 0;
+        for_each_pool([&capacity](mem_pool &pool) { capacity += pool.capacity(); });
+        return capacity;
+    }
+
+    uint64_t committed_bytes() {
+        uint64_t committed = 0;
+        for_each_pool([&committed](mem_pool &pool) { committed += pool.committed_bytes(); });
+        return committed;
+    }
+
+    void trim(std::chrono::steady_clock::duration quiet_period) {
+        for_each_pool([quiet_period](mem_pool &pool) { pool.trim(quiet_period); });
+    }
+
+    // One line per handler type.
+    void print(std::ostream &out) {
+        for_each_pool([&out](mem_pool &pool) {
+            out << "handlers_pool " << pool.name() << " slot_size=" << pool.node_size() << " allocated=" << pool.allocated_count()
+                << " capacity=" << pool.capacity() << " committed_bytes=" << pool.committed_bytes() << "\n";
+        });
+    }
+
+    void close() {
+        for_each_pool([](mem_pool &pool) { pool.close(); });
+    }
+
+    // Calls f with the pool of every handler type. Pools are only ever added, and only before their first handler is
+    // posted.
+    template <class F>
+    void for_each_pool(F &&f) {
+        std::lock_guard lk(_pools_mutex);
+        for (auto &pool : _pools) {
+            f(*pool);
+        }
+    }
+
+private:
+    handlers_pool() = default;
     ~handlers_pool() {
-        _pool->close();
-        delete _pool;
-        _pool = nullptr;
+        close();
     }
-    mem_pool *_pool;
+
+    mem_pool &add_pool() {
+        std::lock_guard lk(_pools_mutex);
+        return *_pools.emplace_back(std::make_unique<mem_pool>());
+    }
+
+    std::mutex                                  _pools_mutex;
+    std::vector<std::unique_ptr<mem_pool>>      _pools;
 };
 
 #endif // GRPC_EXAMPLE_MEMORY_POOL_H
@@ -0,0 +1,384 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+// Tests of the lock-free mem_pool: concurrent allocations, trim() racing with them and regrowing released slabs.
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "memory_pool.h"
+
+namespace {
+
+// A 6KB handler's size class, 341 slots per slab.
+constexpr uint64_t NODE_SIZE = 6144;
+
+// Exposes the pool internals the tests check against.
+class mem_pool_probe : public mem_pool {
+public:
+    uint32_t index_of(const char *ptr) const {
+        return node_index(ptr);
+    }
+
+    uint64_t slab_slots() const {
+        return _slab_slots;
+    }
+
+    uint64_t slab_bytes() const {
+        return _slab_bytes;
+    }
+
+    uint64_t magazine_size() const {
+        return _magazine_size;
+    }
+
+    // Changes with every push to or pop from the shared free list.
+    uint64_t free_head() const {
+        return _free_head.load();
+    }
+
+    // The indexes on the shared free list, only while no other thread uses the pool.
+    std::vector<uint32_t> free_list() const {
+        std::vector<uint32_t> indexes;
+        for (auto index = static_cast<uint32_t>(_free_head.load()); index != INVALID_INDEX; index = _next[index].load()) {
+            indexes.push_back(index);
+        }
+        return indexes;
+    }
+};
+
+// Which thread holds every node, a node handed out twice fails the claim.
+class node_owners {
+public:
+    explicit node_owners(uint64_t capacity) : _owners(new std::atomic<uint32_t>[capacity]()) {}
+
+    bool claim(uint32_t index, uint32_t owner) {
+        uint32_t expected = 0;
+        return _owners[index].compare_exchange_strong(expected, owner);
+    }
+
+    bool release(uint32_t index, uint32_t owner) {
+        uint32_t expected = owner;
+        return _owners[index].compare_exchange_strong(expected, 0);
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint32_t>[]> _owners;
+};
+
+class mem_pool_test : public ::testing::Test {
+protected:
+    void TearDown() override {
+        _pool.close();
+    }
+
+    // Runs f on its own thread, so whatever its magazines hold goes back to the pool when it returns.
+    template <class F>
+    void run_on_thread(F &&f) {
+        std::thread(std::forward<F>(f)).join();
+    }
+
+    // Calls trim() until the pool is down to its initial slabs, false if it never gets there.
+    bool trim_to(uint64_t committed_bytes) {
+        for (int i = 0; i < 64 && _pool.committed_bytes() > committed_bytes; ++i) {
+            _pool.trim(std::chrono::nanoseconds(0));
+        }
+        return _pool.committed_bytes() == committed_bytes;
+    }
+
+    mem_pool_probe _pool;
+};
+
+TEST_F(mem_pool_test, allocated_count_tracks_the_nodes_in_use) {
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE);
+    EXPECT_EQ(_pool.capacity(), _pool.slab_slots());
+    EXPECT_EQ(_pool.node_size(), NODE_SIZE);
+
+    run_on_thread([this] {
+        std::vector<char *> nodes;
+        for (int i = 0; i < 10; ++i) {
+            nodes.push_back(_pool.allocate_node());
+            ASSERT_NE(nodes.back(), nullptr);
+        }
+        EXPECT_EQ(_pool.allocated_count(), 10u);
+        for (int i = 0; i < 4; ++i) {
+            EXPECT_TRUE(_pool.deallocate_node(nodes[i]));
+        }
+        EXPECT_EQ(_pool.allocated_count(), 6u);
+
+        // Double frees and pointers that aren't the start of a node are refused.
+        EXPECT_FALSE(_pool.deallocate_node(nodes[0]));
+        EXPECT_FALSE(_pool.deallocate_node(nodes[5] + 1));
+        char outside;
+        EXPECT_FALSE(_pool.deallocate_node(&outside));
+        EXPECT_EQ(_pool.allocated_count(), 6u);
+
+        for (int i = 4; i < 10; ++i) {
+            EXPECT_TRUE(_pool.deallocate_node(nodes[i]));
+        }
+    });
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+    EXPECT_EQ(_pool.free_count(), _pool.capacity());
+}
+
+TEST_F(mem_pool_test, magazines_serve_small_pools) {
+    // The server's pools hold a handful of handlers each, 16 ServerPing handlers and a single ServerStats one by
+    // default.
+    for (uint64_t count : {1, 4, 16}) {
+        mem_pool_probe pool;
+        pool.init(NODE_SIZE, count, "test", MEM_POOL_MODE_LOCK_FREE);
+        EXPECT_GT(pool.magazine_size(), 0u) << "count=" << count;
+
+        run_on_thread([&pool] {
+            auto node = pool.allocate_node();
+            ASSERT_NE(node, nullptr);
+            ASSERT_TRUE(pool.deallocate_node(node));
+            // A free followed by an allocation on the same thread is served by the thread's magazine, the shared
+            // free list isn't touched.
+            auto head = pool.free_head();
+            for (int i = 0; i < 1000; ++i) {
+                auto again = pool.allocate_node();
+                EXPECT_EQ(again, node);
+                ASSERT_TRUE(pool.deallocate_node(again));
+            }
+            EXPECT_EQ(pool.free_head(), head);
+        });
+        EXPECT_EQ(pool.free_count(), pool.capacity());
+        pool.close();
+    }
+}
+
+TEST_F(mem_pool_test, exhausted_pool_returns_null) {
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE);
+    run_on_thread([this] {
+        std::vector<char *> nodes;
+        for (uint64_t i = 0; i < _pool.capacity(); ++i) {
+            nodes.push_back(_pool.allocate_node());
+            ASSERT_NE(nodes.back(), nullptr);
+        }
+        EXPECT_EQ(_pool.allocate_node(), nullptr);
+        EXPECT_EQ(_pool.allocated_count(), _pool.capacity());
+
+        EXPECT_TRUE(_pool.deallocate_node(nodes.back()));
+        nodes.back() = _pool.allocate_node();
+        EXPECT_NE(nodes.back(), nullptr);
+        for (auto node : nodes) {
+            EXPECT_TRUE(_pool.deallocate_node(node));
+        }
+    });
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+}
+
+TEST_F(mem_pool_test, concurrent_allocations_never_share_a_node) {
+    constexpr uint32_t THREADS = 8;
+    constexpr uint32_t ITERATIONS = 20000;
+    constexpr uint32_t MAX_HELD = 8;
+    _pool.init(NODE_SIZE, THREADS * MAX_HELD, "test", MEM_POOL_MODE_LOCK_FREE);
+    node_owners owners(_pool.capacity());
+    std::atomic<uint64_t> failures{0};
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t <= THREADS; ++t) {
+        threads.emplace_back([this, t, &owners, &failures] {
+            std::minstd_rand random(t);
+            std::vector<char *> held;
+            for (uint32_t i = 0; i < ITERATIONS; ++i) {
+                if (held.size() < MAX_HELD && (held.empty() || random() % 2 == 0)) {
+                    auto node = _pool.allocate_node();
+                    if (node == nullptr || !owners.claim(_pool.index_of(node), t)) {
+                        ++failures;
+                        continue;
+                    }
+                    ::memset(node, static_cast<int>(t), NODE_SIZE);
+                    held.push_back(node);
+                    continue;
+                }
+                auto node = held.back();
+                held.pop_back();
+                // Nobody else wrote to the node while this thread held it.
+                if (node[0] != static_cast<char>(t) || node[NODE_SIZE - 1] != static_cast<char>(t) ||
+                    !owners.release(_pool.index_of(node), t) || !_pool.deallocate_node(node)) {
+                    ++failures;
+                }
+            }
+            for (auto node : held) {
+                owners.release(_pool.index_of(node), t);
+                _pool.deallocate_node(node);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(failures.load(), 0u);
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+    EXPECT_EQ(_pool.free_count(), _pool.capacity());
+}
+
+TEST_F(mem_pool_test, trim_racing_with_allocations) {
+    constexpr uint32_t THREADS = 4;
+    constexpr uint32_t ROUNDS = 200;
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE, 4 * 341);
+    ASSERT_EQ(_pool.slab_slots(), 341u);
+    auto initial_bytes = _pool.committed_bytes();
+    node_owners owners(_pool.capacity());
+    std::atomic<uint64_t> failures{0};
+    std::atomic<bool> stop{false};
+
+    // Trims as fast as it can, so slabs are parked and released while the workers grow the pool back.
+    std::thread trimmer([this, &stop] {
+        while (!stop.load()) {
+            _pool.trim(std::chrono::nanoseconds(0));
+            std::this_thread::yield();
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t <= THREADS; ++t) {
+        threads.emplace_back([this, t, &owners, &failures] {
+            std::minstd_rand random(t);
+            std::vector<char *> held;
+            for (uint32_t round = 0; round < ROUNDS; ++round) {
+                // Bursts of up to 300 nodes per thread need more than a slab between them.
+                auto burst = 1 + random() % 300;
+                for (uint32_t i = 0; i < burst; ++i) {
+                    auto node = _pool.allocate_node();
+                    if (node == nullptr || !owners.claim(_pool.index_of(node), t)) {
+                        ++failures;
+                        continue;
+                    }
+                    ::memset(node, static_cast<int>(t), NODE_SIZE);
+                    held.push_back(node);
+                }
+                for (auto node : held) {
+                    if (node[0] != static_cast<char>(t) || node[NODE_SIZE - 1] != static_cast<char>(t) ||
+                        !owners.release(_pool.index_of(node), t) || !_pool.deallocate_node(node)) {
+                        ++failures;
+                    }
+                }
+                held.clear();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    stop.store(true);
+    trimmer.join();
+
+    EXPECT_EQ(failures.load(), 0u);
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+    // Once the load is gone every slab but the initial one goes back to the OS.
+    EXPECT_TRUE(trim_to(initial_bytes));
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+}
+
+TEST_F(mem_pool_test, released_slabs_are_grown_back) {
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE, 3 * 341);
+    auto slab_bytes = _pool.slab_bytes();
+    ASSERT_EQ(_pool.committed_bytes(), slab_bytes);
+
+    auto fill = [this] {
+        std::vector<char *> nodes;
+        for (uint64_t i = 0; i < _pool.capacity(); ++i) {
+            nodes.push_back(_pool.allocate_node());
+            ASSERT_NE(nodes.back(), nullptr);
+            ::memset(nodes.back(), 0x5a, NODE_SIZE);
+        }
+        EXPECT_EQ(_pool.allocate_node(), nullptr);
+        EXPECT_EQ(_pool.committed_bytes(), 3 * _pool.slab_bytes());
+        for (auto node : nodes) {
+            ASSERT_TRUE(_pool.deallocate_node(node));
+        }
+    };
+
+    run_on_thread(fill);
+    EXPECT_TRUE(trim_to(slab_bytes));
+    EXPECT_EQ(_pool.free_count(), _pool.slab_slots());
+
+    // The released slabs are activated again, all of them, and their (zeroed) pages are usable.
+    run_on_thread(fill);
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+    EXPECT_TRUE(trim_to(slab_bytes));
+}
+
+TEST_F(mem_pool_test, parked_slab_is_revived_by_an_allocation) {
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE, 2 * 341);
+    std::vector<char *> held;
+    run_on_thread([this, &held] {
+        for (uint64_t i = 0; i < _pool.capacity(); ++i) {
+            held.push_back(_pool.allocate_node());
+        }
+    });
+    // Only the second slab's last node stays in use: the slab is parked but can't be released.
+    run_on_thread([this, &held] {
+        for (size_t i = 0; i + 1 < held.size(); ++i) {
+            _pool.deallocate_node(held[i]);
+        }
+    });
+    _pool.trim(std::chrono::nanoseconds(0));
+    _pool.trim(std::chrono::nanoseconds(0));
+    EXPECT_TRUE(_pool.in_parking_slab(held.back()));
+    EXPECT_EQ(_pool.committed_bytes(), 2 * _pool.slab_bytes());
+
+    // Taking more than the first slab holds puts the parking slab back to use.
+    run_on_thread([this] {
+        std::vector<char *> nodes;
+        for (uint64_t i = 0; i + 1 < _pool.capacity(); ++i) {
+            nodes.push_back(_pool.allocate_node());
+            ASSERT_NE(nodes.back(), nullptr);
+        }
+        for (auto node : nodes) {
+            _pool.deallocate_node(node);
+        }
+    });
+    EXPECT_FALSE(_pool.in_parking_slab(held.back()));
+    EXPECT_EQ(_pool.allocated_count(), 1u);
+    run_on_thread([this, &held] {
+        EXPECT_TRUE(_pool.deallocate_node(held.back()));
+    });
+    EXPECT_EQ(_pool.allocated_count(), 0u);
+}
+
+TEST_F(mem_pool_test, parking_unlinks_only_the_parking_slab_nodes) {
+    _pool.init(NODE_SIZE, 16, "test", MEM_POOL_MODE_LOCK_FREE, 2 * 341);
+    std::vector<char *> held;
+    run_on_thread([this, &held] {
+        for (uint64_t i = 0; i < _pool.capacity(); ++i) {
+            held.push_back(_pool.allocate_node());
+        }
+    });
+    // The second slab's last node stays in use, so the slab stays parked with its other nodes freed.
+    run_on_thread([this, &held] {
+        for (size_t i = 0; i + 1 < held.size(); ++i) {
+            _pool.deallocate_node(held[i]);
+        }
+    });
+    _pool.trim(std::chrono::nanoseconds(0));
+    _pool.trim(std::chrono::nanoseconds(0));
+    ASSERT_TRUE(_pool.in_parking_slab(held.back()));
+
+    auto free_list = _pool.free_list();
+    EXPECT_EQ(free_list.size(), _pool.slab_slots());
+    for (auto index : free_list) {
+        EXPECT_LT(index, _pool.slab_slots());
+    }
+    // With no free node left in the parking slab, trim() leaves the shared free list alone.
+    auto head = _pool.free_head();
+    _pool.trim(std::chrono::nanoseconds(0));
+    EXPECT_EQ(_pool.free_head(), head);
+
+    run_on_thread([this, &held] {
+        EXPECT_TRUE(_pool.deallocate_node(held.back()));
+    });
+    EXPECT_TRUE(trim_to(_pool.slab_bytes()));
+}
+
+}
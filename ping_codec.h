@@ -0,0 +1,155 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_PING_CODEC_H
+#define GRPC_EXAMPLE_PING_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Hand written protobuf wire format of the two ServerPing messages, for the raw ServerPing handler:
+//   ServerPingRequest  { ServerPing ping = 1; }                 ServerPing { uint64 ping_generation = 1; }
+//   ServerPingResponse { ServerPong pong = 2; }                 ServerPong { ServerPing ping = 1; uint64 pings_so_far = 2; }
+// Has to be kept in sync with example.proto.
+namespace ping_codec {
+
+constexpr uint32_t WIRE_TYPE_VARINT = 0;
+constexpr uint32_t WIRE_TYPE_FIXED64 = 1;
+constexpr uint32_t WIRE_TYPE_LENGTH_DELIMITED = 2;
+constexpr uint32_t WIRE_TYPE_FIXED32 = 5;
+constexpr size_t MAX_VARINT_SIZE = 10;
+// Tags and lengths of the response all fit a single byte.
+constexpr size_t MAX_RESPONSE_SIZE = 6 + 2 * MAX_VARINT_SIZE;
+
+inline bool read_varint(const uint8_t *&pos, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint8_t *write_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+inline size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// Skips a field of the given wire type, groups are not used by the ping messages and are rejected.
+inline bool skip_field(const uint8_t *&pos, const uint8_t *end, uint32_t wire_type) {
+    uint64_t value;
+    switch (wire_type) {
+        case WIRE_TYPE_VARINT:
+            return read_varint(pos, end, value);
+        case WIRE_TYPE_FIXED64:
+            if (end - pos < 8) {
+                return false;
+            }
+            pos += 8;
+            return true;
+        case WIRE_TYPE_LENGTH_DELIMITED:
+            if (!read_varint(pos, end, value) || value > static_cast<uint64_t>(end - pos)) {
+                return false;
+            }
+            pos += value;
+            return true;
+        case WIRE_TYPE_FIXED32:
+            if (end - pos < 4) {
+                return false;
+            }
+            pos += 4;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Decodes the fields of a message, calling on_field(field_number, wire_type, pos, end) for each one. The callback
+// consumes the field and returns false to reject the message, unknown fields are skipped when it returns true
+// without moving pos.
+template <class F>
+inline bool for_each_field(const uint8_t *pos, const uint8_t *end, F on_field) {
+    while (pos < end) {
+        uint64_t tag;
+        // Like protobuf, field numbers run from 1 to 2^29 - 1, so a tag always fits 32 bits.
+        if (!read_varint(pos, end, tag) || (tag >> 3) == 0 || tag > UINT32_MAX) {
+            return false;
+        }
+        auto wire_type = static_cast<uint32_t>(tag & 7);
+        auto field_start = pos;
+        if (!on_field(static_cast<uint32_t>(tag >> 3), wire_type, pos, end)) {
+            return false;
+        }
+        if (pos == field_start && !skip_field(pos, end, wire_type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Extracts ping.ping_generation from a serialized ServerPingRequest, false if the message is malformed.
+inline bool decode_request(const uint8_t *data, size_t size, uint64_t &ping_generation) {
+    ping_generation = 0;
+    return for_each_field(data, data + size, [&](uint32_t field, uint32_t wire_type, const uint8_t *&pos, const uint8_t *end) {
+        if (field != 1 || wire_type != WIRE_TYPE_LENGTH_DELIMITED) {
+            return true;
+        }
+        uint64_t length;
+        if (!read_varint(pos, end, length) || length > static_cast<uint64_t>(end - pos)) {
+            return false;
+        }
+        auto ping_end = pos + length;
+        // Like protobuf, the last occurrence of a field wins.
+        auto ok = for_each_field(pos, ping_end, [&](uint32_t ping_field, uint32_t ping_wire_type, const uint8_t *&ping_pos, const uint8_t *) {
+            if (ping_field == 1 && ping_wire_type == WIRE_TYPE_VARINT) {
+                return read_varint(ping_pos, ping_end, ping_generation);
+            }
+            return true;
+        });
+        pos = ping_end;
+        return ok;
+    });
+}
+
+// Writes the serialized ServerPingResponse into out (at least MAX_RESPONSE_SIZE bytes), returns its size. Matches what
+// protobuf writes for the typed handler, which always sets pong.ping.
+inline size_t encode_response(uint64_t ping_generation, uint64_t pings_so_far, uint8_t *out) {
+    size_t ping_size = ping_generation != 0 ? 1 + varint_size(ping_generation) : 0;
+    size_t pong_size = 2 + ping_size + (pings_so_far != 0 ? 1 + varint_size(pings_so_far) : 0);
+
+    auto pos = out;
+    *pos++ = (2 << 3) | WIRE_TYPE_LENGTH_DELIMITED;
+    *pos++ = static_cast<uint8_t>(pong_size);
+    *pos++ = (1 << 3) | WIRE_TYPE_LENGTH_DELIMITED;
+    *pos++ = static_cast<uint8_t>(ping_size);
+    if (ping_generation != 0) {
+        *pos++ = (1 << 3) | WIRE_TYPE_VARINT;
+        pos = write_varint(pos, ping_generation);
+    }
+    if (pings_so_far != 0) {
+        *pos++ = (2 << 3) | WIRE_TYPE_VARINT;
+        pos = write_varint(pos, pings_so_far);
+    }
+    return pos - out;
+}
+
+} // namespace ping_codec
+
+#endif //GRPC_EXAMPLE_PING_CODEC_H
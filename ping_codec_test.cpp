@@ -0,0 +1,199 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+// ping_codec against the generated protobuf classes: whatever protobuf writes the codec reads back the same, and what
+// the codec writes is byte for byte what protobuf writes.
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "example/v1/example.pb.h"
+#include "ping_codec.h"
+
+using namespace example::v1;
+
+namespace {
+
+constexpr int ROUNDS = 20000;
+
+class ping_codec_test : public ::testing::Test {
+protected:
+    // Any magnitude is as likely as another, so the varints come in every size.
+    uint64_t random_value() {
+        auto bits = _random() % 65;
+        return bits == 0 ? 0 : _random() >> (64 - bits);
+    }
+
+    void append_varint(std::string &out, uint64_t value) {
+        uint8_t buffer[ping_codec::MAX_VARINT_SIZE];
+        auto end = ping_codec::write_varint(buffer, value);
+        out.append(reinterpret_cast<char *>(buffer), end - buffer);
+    }
+
+    void append_tag(std::string &out, uint32_t field, uint32_t wire_type) {
+        append_varint(out, (static_cast<uint64_t>(field) << 3) | wire_type);
+    }
+
+    // A field protobuf keeps as unknown, of any wire type but groups.
+    void append_unknown_field(std::string &out) {
+        auto field = 3 + static_cast<uint32_t>(_random() % 1000);
+        switch (_random() % 4) {
+            case 0:
+                append_tag(out, field, ping_codec::WIRE_TYPE_VARINT);
+                append_varint(out, random_value());
+                break;
+            case 1:
+                append_tag(out, field, ping_codec::WIRE_TYPE_FIXED64);
+                out.append(8, static_cast<char>(_random()));
+                break;
+            case 2: {
+                append_tag(out, field, ping_codec::WIRE_TYPE_LENGTH_DELIMITED);
+                auto length = _random() % 20;
+                append_varint(out, length);
+                out.append(length, static_cast<char>(_random()));
+                break;
+            }
+            default:
+                append_tag(out, field, ping_codec::WIRE_TYPE_FIXED32);
+                out.append(4, static_cast<char>(_random()));
+                break;
+        }
+    }
+
+    // A ServerPingRequest the way any client may send it: unknown fields anywhere, ping sent more than once (protobuf
+    // merges the occurrences), ping_generation repeated inside a ping (the last one wins).
+    std::string random_request() {
+        std::string request;
+        auto pings = _random() % 3;
+        for (uint64_t i = 0; i < pings; ++i) {
+            if (_random() % 4 == 0) {
+                append_unknown_field(request);
+            }
+            std::string ping;
+            auto fields = _random() % 4;
+            for (uint64_t f = 0; f < fields; ++f) {
+                if (_random() % 3 == 0) {
+                    append_unknown_field(ping);
+                }
+                else {
+                    append_tag(ping, 1, ping_codec::WIRE_TYPE_VARINT);
+                    append_varint(ping, random_value());
+                }
+            }
+            append_tag(request, 1, ping_codec::WIRE_TYPE_LENGTH_DELIMITED);
+            append_varint(request, ping.size());
+            request += ping;
+        }
+        if (_random() % 4 == 0) {
+            append_unknown_field(request);
+        }
+        return request;
+    }
+
+    static bool decode(const std::string &data, uint64_t &ping_generation) {
+        return ping_codec::decode_request(reinterpret_cast<const uint8_t *>(data.data()), data.size(), ping_generation);
+    }
+
+    std::mt19937_64 _random{42};
+};
+
+TEST_F(ping_codec_test, decodes_what_protobuf_serializes) {
+    for (int i = 0; i < ROUNDS; ++i) {
+        ServerPingRequest request;
+        if (_random() % 4 != 0) {
+            request.mutable_ping()->set_ping_generation(random_value());
+        }
+        uint64_t ping_generation = 1;
+        ASSERT_TRUE(decode(request.SerializeAsString(), ping_generation));
+        ASSERT_EQ(ping_generation, request.ping().ping_generation());
+    }
+}
+
+TEST_F(ping_codec_test, decodes_like_protobuf_parses) {
+    for (int i = 0; i < ROUNDS; ++i) {
+        auto data = random_request();
+        ServerPingRequest request;
+        ASSERT_TRUE(request.ParseFromString(data));
+        uint64_t ping_generation = 1;
+        ASSERT_TRUE(decode(data, ping_generation));
+        ASSERT_EQ(ping_generation, request.ping().ping_generation()) << "round " << i;
+    }
+}
+
+TEST_F(ping_codec_test, rejects_truncated_requests_like_protobuf) {
+    for (int i = 0; i < ROUNDS / 10; ++i) {
+        auto data = random_request();
+        for (size_t size = 0; size < data.size(); ++size) {
+            auto prefix = data.substr(0, size);
+            ServerPingRequest request;
+            auto parsed = request.ParseFromString(prefix);
+            uint64_t ping_generation = 1;
+            ASSERT_EQ(decode(prefix, ping_generation), parsed) << "round " << i << " size " << size;
+            if (parsed) {
+                ASSERT_EQ(ping_generation, request.ping().ping_generation());
+            }
+        }
+    }
+}
+
+TEST_F(ping_codec_test, rejects_malformed_requests) {
+    uint64_t ping_generation;
+    // Field number 0.
+    EXPECT_FALSE(decode(std::string("\x00\x01", 2), ping_generation));
+    // A varint longer than 10 bytes.
+    EXPECT_FALSE(decode(std::string("\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 12), ping_generation));
+    // ping longer than what is left of the message.
+    EXPECT_FALSE(decode(std::string("\x0a\x05\x08\x01", 4), ping_generation));
+    // A length that overflows when added to the position.
+    EXPECT_FALSE(decode(std::string("\x0a\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 11), ping_generation));
+    // A truncated ping_generation inside a complete ping.
+    EXPECT_FALSE(decode(std::string("\x0a\x02\x08\x80", 4), ping_generation));
+    // Wire types 6 and 7 don't exist, groups (3 and 4) aren't used by the ping messages.
+    EXPECT_FALSE(decode(std::string("\x1e\x00", 2), ping_generation));
+    EXPECT_FALSE(decode(std::string("\x1f\x00", 2), ping_generation));
+    EXPECT_FALSE(decode(std::string("\x1b\x1c", 2), ping_generation));
+    // The empty message is a ServerPingRequest without a ping.
+    EXPECT_TRUE(decode(std::string(), ping_generation));
+    EXPECT_EQ(ping_generation, 0u);
+}
+
+TEST_F(ping_codec_test, random_bytes_decode_only_when_protobuf_parses) {
+    // Random bytes may hold groups, which the codec rejects and protobuf keeps as unknown fields. Anything the codec
+    // accepts protobuf must accept too, with the same ping_generation.
+    for (int i = 0; i < ROUNDS; ++i) {
+        std::string data(_random() % 16, '\0');
+        for (auto &byte : data) {
+            byte = static_cast<char>(_random());
+        }
+        uint64_t ping_generation = 1;
+        if (decode(data, ping_generation)) {
+            ServerPingRequest request;
+            ASSERT_TRUE(request.ParseFromString(data)) << "round " << i;
+            ASSERT_EQ(ping_generation, request.ping().ping_generation()) << "round " << i;
+        }
+    }
+}
+
+TEST_F(ping_codec_test, encodes_what_protobuf_serializes) {
+    for (int i = 0; i < ROUNDS; ++i) {
+        auto ping_generation = random_value();
+        auto pings_so_far = random_value();
+        ServerPingResponse response;
+        // The typed handler always sets pong.ping, even to a ping without a generation.
+        response.mutable_pong()->mutable_ping()->set_ping_generation(ping_generation);
+        response.mutable_pong()->set_pings_so_far(pings_so_far);
+
+        uint8_t encoded[ping_codec::MAX_RESPONSE_SIZE];
+        auto size = ping_codec::encode_response(ping_generation, pings_so_far, encoded);
+        ASSERT_EQ(std::string(reinterpret_cast<char *>(encoded), size), response.SerializeAsString())
+            << "ping_generation=" << ping_generation << " pings_so_far=" << pings_so_far;
+    }
+
+    // The largest response fits MAX_RESPONSE_SIZE exactly.
+    uint8_t encoded[ping_codec::MAX_RESPONSE_SIZE];
+    EXPECT_EQ(ping_codec::encode_response(UINT64_MAX, UINT64_MAX, encoded), ping_codec::MAX_RESPONSE_SIZE);
+}
+
+}
@@ -0,0 +1,166 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "replay.h"
+
+#include <iostream>
+#include <thread>
+#include <google/protobuf/util/json_util.h>
+
+#include "example/v1/capture.pb.h"
+
+using namespace example::v1;
+
+using std::endl;
+using std::cout;
+
+struct replay_engine::channel {
+    std::shared_ptr<grpc::Channel>          grpc_channel;
+    std::unique_ptr<ExampleService::Stub>   stub;
+    grpc::CompletionQueue                   completion_queue;
+    load_report                             report;
+    std::thread                             thread;
+};
+
+replay_engine::replay_engine(const replay_options &options) : _options(options), _in_flight(0), _skipped_lines(0) {
+    _options.channels = std::max<uint32_t>(1, _options.channels);
+    _options.concurrency = std::max<uint32_t>(1, _options.concurrency);
+}
+
+bool replay_engine::run(load_report &report) {
+    std::ifstream input(_options.input);
+    if (!input) {
+        cout << "Failed opening capture file '" << _options.input << "'" << endl;
+        return false;
+    }
+    if (!_options.output.empty()) {
+        _output.open(_options.output, std::ios::trunc);
+        if (!_output) {
+            cout << "Failed opening output file '" << _options.output << "'" << endl;
+            return false;
+        }
+        _output << "line,rpc,status_code,latency_us" << endl;
+    }
+
+    std::vector<std::unique_ptr<channel>> channels;
+    for (uint32_t i = 0; i < _options.channels; ++i) {
+        auto ch = std::make_unique<channel>();
+        ch->grpc_channel = create_load_channel(_options.address, i);
+        ch->stub = ExampleService::NewStub(ch->grpc_channel);
+        if (!ch->grpc_channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5))) {
+            cout << "Failed connecting to " << _options.address << endl;
+            return false;
+        }
+        channels.emplace_back(std::move(ch));
+    }
+    for (auto &ch : channels) {
+        ch->thread = std::thread(&replay_engine::complete_requests, this, std::ref(*ch));
+    }
+
+    auto start = clock::now();
+    send_requests(input, channels);
+
+    // Everything was sent, wait for the last responses before closing the queues.
+    {
+        std::unique_lock lk(_in_flight_mutex);
+        _in_flight_cv.wait(lk, [this] { return _in_flight == 0; });
+    }
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    for (auto &ch : channels) {
+        ch->completion_queue.Shutdown();
+    }
+    for (auto &ch : channels) {
+        ch->thread.join();
+        report.merge(ch->report);
+    }
+    report.elapsed_sec = elapsed;
+
+    if (_skipped_lines != 0) {
+        cout << "Skipped " << _skipped_lines << " capture line(s) that are not a ServerPing/VersionGet request" << endl;
+    }
+    return true;
+}
+
+void replay_engine::send_requests(std::ifstream &input, std::vector<std::unique_ptr<channel>> &channels) {
+    google::protobuf::util::JsonParseOptions parse_options;
+    parse_options.ignore_unknown_fields = true;
+
+    CapturedRequest captured;
+    std::string line;
+    uint64_t line_number = 0;
+    uint32_t next_channel = 0;
+    auto start = clock::now();
+
+    while (std::getline(input, line)) {
+        ++line_number;
+        if (line.empty()) {
+            continue;
+        }
+        captured.Clear();
+        if (!google::protobuf::util::JsonStringToMessage(line, &captured, parse_options).ok() ||
+            captured.request_case() == CapturedRequest::REQUEST_NOT_SET) {
+            ++_skipped_lines;
+            continue;
+        }
+
+        auto due = clock::now();
+        if (_options.speed > 0) {
+            due = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::micro>(captured.offset_us() / _options.speed));
+            std::this_thread::sleep_until(due);
+        }
+        {
+            std::unique_lock lk(_in_flight_mutex);
+            _in_flight_cv.wait(lk, [this] { return _in_flight < _options.concurrency; });
+            ++_in_flight;
+        }
+
+        auto call = new async_call();
+        call->id = line_number;
+        call->scheduled = due;
+        if (captured.has_server_ping()) {
+            call->type = RPC_TYPE_SERVER_PING;
+            call->server_ping_request.Swap(captured.mutable_server_ping());
+        }
+        else {
+            call->type = RPC_TYPE_VERSION_GET;
+            call->version_get_request.Swap(captured.mutable_version_get());
+        }
+        auto &ch = *channels[next_channel++ % channels.size()];
+        call->start(*ch.stub, ch.completion_queue);
+    }
+}
+
+void replay_engine::complete_requests(channel &ch) {
+    void *tag = nullptr;
+    bool ok = false;
+    std::string buffer;
+
+    while (ch.completion_queue.Next(&tag, &ok)) {
+        auto call = static_cast<async_call *>(tag);
+        auto latency_ns = ch.report.record(*call);
+        if (_output.is_open()) {
+            buffer += std::to_string(call->id) + "," + rpc_type_name(call->type) + "," + std::to_string(call->status.error_code()) + ","
+                      + std::to_string(latency_ns / 1000.0) + "\n";
+            write_latency(buffer, false);
+        }
+        delete call;
+
+        {
+            std::lock_guard lk(_in_flight_mutex);
+            --_in_flight;
+        }
+        _in_flight_cv.notify_all();
+    }
+    write_latency(buffer, true);
+}
+
+void replay_engine::write_latency(std::string &buffer, bool flush) {
+    // Completion threads batch their lines so the shared file is locked once per ~64KB.
+    if (buffer.empty() || (!flush && buffer.size() < 64 * 1024)) {
+        return;
+    }
+    std::lock_guard lk(_output_mutex);
+    _output << buffer;
+    buffer.clear();
+}
@@ -0,0 +1,53 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_REPLAY_H
+#define GRPC_EXAMPLE_REPLAY_H
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "load_generator.h"
+
+struct replay_options {
+    std::string     address = "127.0.0.1:6212";
+    // JSONL capture, one example.v1.CapturedRequest per line.
+    std::string     input;
+    // Optional CSV file receiving the latency of every replayed request.
+    std::string     output;
+    uint32_t        channels = 1;
+    // Cap on the requests in flight, the schedule slips when it is reached.
+    uint32_t        concurrency = 64;
+    // Replay speed relative to the capture's offsets (2 replays twice as fast), 0 ignores them and replays at max speed.
+    double          speed = 1.0;
+};
+
+// Streams a traffic capture to the server: requests are read and sent as the replay goes, each one when its offset
+// (scaled by the speed) is due. Paced requests are timed from their due time, like the open loop load generator.
+class replay_engine {
+public:
+    explicit replay_engine(const replay_options &options);
+    bool run(load_report &report);
+
+    using clock = std::chrono::steady_clock;
+
+private:
+    struct channel;
+
+    void send_requests(std::ifstream &input, std::vector<std::unique_ptr<channel>> &channels);
+    void complete_requests(channel &ch);
+    void write_latency(std::string &buffer, bool flush);
+
+    replay_options              _options;
+    std::mutex                  _in_flight_mutex;
+    std::condition_variable     _in_flight_cv;
+    uint32_t                    _in_flight;
+    uint64_t                    _skipped_lines;
+    std::mutex                  _output_mutex;
+    std::ofstream               _output;
+};
+
+#endif //GRPC_EXAMPLE_REPLAY_H
@@ -3,15 +3,19 @@
 //
 
 #include "server.h"
+#include "callback_service.h"
 #include "handlers.h"
 
+#include <algorithm>
 #include <chrono>
+#include <limits>
 #include <sstream>
 #include <memory>
-#include <cstdlib>
 #include <iostream>
+#include <pthread.h>
 
-constexpr int MAX_RETRY_COUNT = 10;
+// Failed tags are logged at most once per interval per queue thread, with how many failed in between.
+constexpr auto FAILED_TAG_LOG_INTERVAL = std::chrono::seconds(1);
 
 using namespace grpc;
 using namespace std::chrono_literals;
@@ -20,56 +24,129 @@ using namespace google::protobuf;
 using std::endl;
 using std::cout;
 
-void server::init_rpc_handlers() {
-    // Create the command handlers
-    auto _cmd_ping = (handler_base *)handlers_pool::get_pool().allocator().allocate_node();
-    _cmd_ping = new (_cmd_ping) handler_server_ping(_completion_queue.get(), _service);
+template <class H>
+static handler_base *create_rpc_handler(handler_group &group) {
+    auto &pool = handlers_pool::get_pool();
+    auto slot = pool.allocate<H>();
+    if (slot == nullptr) {
+        server_metrics::get_metrics().increment(SERVER_COUNTER_POOL_EXHAUSTED);
+        return nullptr;
+    }
+    handler_base *handler = new (slot) H(group.completion_queue, group.service);
+    handler->attach(group, pool.type_pool<H>());
+    handler->init_rpc_handler();
+    return handler;
+}
+
+template <class H>
+void server::init_handlers_pool(const std::string &name, uint32_t count) {
+    // Handlers are posted on every completion queue, the callback reactors are shared by all of the executor's threads.
+    auto queues = _config.callback_api ? 1 : _config.completion_queues;
+    handlers_pool::get_pool().init<H>(name, queues * count, queues * _config.max_handlers(count), _config.huge_pages);
+}
+
+void server::init_handlers_pools() {
+    if (_config.callback_api) {
+        // The reactors of the calls in flight, the pools grow on demand. They are sized like the handlers of a single
+        // completion queue, as that many calls are taken in parallel there.
+        init_handlers_pool<unary_reactor>("unary_reactor", _config.server_ping_handlers + _config.version_get_handlers + _config.server_ping_batch_handlers +
+                                                           _config.server_stats_handlers);
+        init_handlers_pool<ping_stream_reactor>("ping_stream_reactor", _config.server_ping_stream_handlers);
+        init_handlers_pool<server_ping_allocator::holder>("server_ping_messages", _config.server_ping_handlers);
+        init_handlers_pool<server_ping_batch_allocator::holder>("server_ping_batch_messages", _config.server_ping_batch_handlers);
+        init_handlers_pool<server_stats_allocator::holder>("server_stats_messages", _config.server_stats_handlers);
+        return;
+    }
 
-    auto _cmd_get_version = (handler_base *)handlers_pool::get_pool().allocator().allocate_node();
-    _cmd_get_version = new (_cmd_get_version) handler_version_get(_completion_queue.get(), _service);
+    // Sized for every completion queue, a type's handlers on all queues share its pool.
+    if (_config.raw_server_ping) {
+        init_handlers_pool<handler_server_ping_raw>("server_ping_raw", _config.server_ping_handlers);
+    }
+    else {
+        init_handlers_pool<handler_server_ping>("server_ping", _config.server_ping_handlers);
+    }
+    init_handlers_pool<handler_version_get>("version_get", _config.version_get_handlers);
+    init_handlers_pool<handler_server_ping_batch>("server_ping_batch", _config.server_ping_batch_handlers);
+    init_handlers_pool<handler_server_ping_stream>("server_ping_stream", _config.server_ping_stream_handlers);
+    init_handlers_pool<handler_server_stats>("server_stats", _config.server_stats_handlers);
+}
+
+template <class H>
+bool server::post_rpc_handlers(uint32_t count, grpc::ServerCompletionQueue *completion_queue) {
+    auto group = std::make_unique<handler_group>();
+    group->completion_queue = completion_queue;
+    group->service = _service;
+    group->base_count = count;
+    group->max_count = _config.max_handlers(count);
+    group->create = create_rpc_handler<H>;
+    auto &posted = *_handler_groups.emplace_back(std::move(group));
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!posted.grow()) {
+            SERVER_LOG(ERROR) << "handlers pool is exhausted, only " << i << " out of " << count << " handlers were posted";
+            return false;
+        }
+    }
+    return true;
+}
 
-    _cmd_ping->init_rpc_handler();
-    _cmd_get_version->init_rpc_handler();
+void server::init_rpc_handlers(grpc::ServerCompletionQueue *completion_queue) {
+    // Create the command handlers, every completion queue gets its own instances.
+    if (_config.raw_server_ping) {
+        post_rpc_handlers<handler_server_ping_raw>(_config.server_ping_handlers, completion_queue);
+    }
+    else {
+        post_rpc_handlers<handler_server_ping>(_config.server_ping_handlers, completion_queue);
+    }
+    post_rpc_handlers<handler_version_get>(_config.version_get_handlers, completion_queue);
+    post_rpc_handlers<handler_server_ping_batch>(_config.server_ping_batch_handlers, completion_queue);
+    post_rpc_handlers<handler_server_ping_stream>(_config.server_ping_stream_handlers, completion_queue);
+    post_rpc_handlers<handler_server_stats>(_config.server_stats_handlers, completion_queue);
 }
 
-void server::handle_requests_queue() {
+void server::handle_requests_queue(grpc::ServerCompletionQueue *completion_queue) {
     void *rpc_tag = nullptr;  // uniquely identifies a request.
     auto rpc_status = false;
-    uint16_t retry_count = 0;
+    uint64_t failures_since_log = 0;
+    std::chrono::steady_clock::time_point last_failure_log;
 
     while (true) {
-        auto ret = _completion_queue->Next(&rpc_tag, &rpc_status);
+        auto ret = completion_queue->Next(&rpc_tag, &rpc_status);
         if (!ret) {
-            cout << "completion_queue next method indicates that the gRPC server is shutting down, ret=" << ret << ", rpc_status=" << rpc_status << ", did_we_initiate=" << is_server_shutting_down() << endl;
+            SERVER_LOG(INFO) << "completion_queue next method indicates that the gRPC server is shutting down, ret=" << ret << ", rpc_status=" << rpc_status << ", did_we_initiate=" << is_server_shutting_down();
             break;
         }
-        if (!rpc_status) {
-            cout << "completion_queue next method indicates that an RPC request failed, moving to next request, retry_count=" << retry_count << endl;
-
-            if (rpc_tag) {
-                auto rpc_handler = static_cast<handler_base *>(rpc_tag);
-                cout << "Failed rpc request details-> " << rpc_handler->get_request_debug_message() << endl;
+        if (!rpc_status && is_server_shutting_down()) {
+            // Handlers still waiting for a call come back failed once the server shuts down, the thread keeps
+            // draining the queue so calls in flight can finish, until the queue itself is shut down.
+            auto rpc_handler = static_cast<handler_base *>(rpc_tag);
+            if (rpc_handler && !rpc_handler->handle_rpc_failure()) {
                 rpc_handler->complete_request();
             }
-
-            if (is_server_shutting_down()) {
-                cout << "completion_queue next method indicates that the gRPC server is shutting down, ret=" << ret << ", rpc_status=" << rpc_status << endl;
-                break;
-            }
-
-            if (retry_count < MAX_RETRY_COUNT) {
-                ++retry_count;
-                std::this_thread::sleep_for(5ms);
+            continue;
+        }
+        if (!rpc_status && rpc_tag && static_cast<handler_base *>(rpc_tag)->handle_rpc_failure()) {
+            // A failure that is part of the rpc, like the client closing its side of a stream.
+            continue;
+        }
+        if (!rpc_status) {
+            // The failed call is completed and its handler re-armed right away, the queue is never stalled over it:
+            // under overload the failures are cancelled and expired calls, and draining the queue is what helps.
+            server_metrics::get_metrics().increment(SERVER_COUNTER_FAILED_TAGS);
+            ++failures_since_log;
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_failure_log >= FAILED_TAG_LOG_INTERVAL) {
+                SERVER_LOG(WARNING) << "completion_queue next method indicates that " << failures_since_log << " RPC request(s) failed since the last report"
+                                    << (rpc_tag ? ", last one: " + static_cast<handler_base *>(rpc_tag)->get_request_debug_message() : std::string());
+                failures_since_log = 0;
+                last_failure_log = now;
             }
-            else {
-                cout << "Retry count exceeded the configured max, can't recover - killing the agent" << endl;
-                ::abort();
+            if (rpc_tag) {
+                static_cast<handler_base *>(rpc_tag)->complete_request();
             }
             continue;
         }
-        retry_count = 0;
         if (!rpc_tag) {
-            cout << "invalid RPC request moving to next request" << endl;
+            SERVER_LOG(WARNING) << "invalid RPC request moving to next request";
             continue;
         }
 
@@ -77,43 +154,206 @@ void server::handle_requests_queue() {
     }
 }
 
+void server::pin_thread(thread &server_thread, uint32_t thread_index) {
+    auto cores = std::thread::hardware_concurrency();
+    if (cores == 0) {
+        return;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(thread_index % cores, &cpu_set);
+    auto ret = pthread_setaffinity_np(server_thread.native_handle(), sizeof(cpu_set), &cpu_set);
+    if (ret != 0) {
+        SERVER_LOG(WARNING) << "Failed pinning completion queue thread " << thread_index << " to core " << thread_index % cores << ", error=" << ret;
+    }
+}
+
+void server::dump_metrics(std::ostream &out) {
+    server_metrics::get_metrics().snapshot().print(out);
+    handlers_pool::get_pool().print(out);
+}
+
+void server::print_metrics() {
+    // The table is written in one go so log lines written meanwhile don't end up inside it.
+    std::ostringstream metrics;
+    dump_metrics(metrics);
+    cout << metrics.str() << std::flush;
+}
+
+std::shared_ptr<grpc::Channel> server::in_process_channel(const grpc::ChannelArguments &args) {
+    if (!_did_init) {
+        return nullptr;
+    }
+    return _server->InProcessChannel(args);
+}
+
+void server::run_housekeeping() {
+    auto next_dump = std::chrono::steady_clock::now() + std::chrono::seconds(_config.metrics_interval_sec);
+    std::unique_lock lk(_housekeeping_mutex);
+    while (!_housekeeping_cv.wait_for(lk, 1s, [this] { return is_server_shutting_down(); })) {
+        if (_config.pool_idle_release_sec > 0) {
+            handlers_pool::get_pool().trim(std::chrono::seconds(_config.pool_idle_release_sec));
+        }
+        if (_config.metrics_interval_sec > 0 && std::chrono::steady_clock::now() >= next_dump) {
+            next_dump += std::chrono::seconds(_config.metrics_interval_sec);
+            print_metrics();
+        }
+    }
+}
+
+static int to_channel_arg(uint32_t value) {
+    return static_cast<int>(std::min<uint32_t>(value, std::numeric_limits<int>::max()));
+}
+
+static bool parse_compression(const std::string &name, grpc_compression_algorithm &algorithm) {
+    if (name == "none") {
+        algorithm = GRPC_COMPRESS_NONE;
+    }
+    else if (name == "deflate") {
+        algorithm = GRPC_COMPRESS_DEFLATE;
+    }
+    else if (name == "gzip") {
+        algorithm = GRPC_COMPRESS_GZIP;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// The settings of gRPC itself, those left at 0 keep gRPC's defaults.
+static void apply_builder_options(const server_config &config, ServerBuilder &builder) {
+    builder.SetMaxMessageSize(to_channel_arg(config.max_message_size));
+    builder.SetMaxSendMessageSize(to_channel_arg(config.max_message_size));
+    builder.SetMaxReceiveMessageSize(to_channel_arg(config.max_message_size));
+
+    if (config.resource_quota_mb > 0) {
+        grpc::ResourceQuota quota("grpc_example");
+        quota.Resize(static_cast<size_t>(config.resource_quota_mb) << 20);
+        builder.SetResourceQuota(quota);
+    }
+    if (config.max_concurrent_streams > 0) {
+        builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, to_channel_arg(config.max_concurrent_streams));
+    }
+    if (config.http2_stream_window_bytes > 0) {
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, to_channel_arg(config.http2_stream_window_bytes));
+    }
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, config.http2_bdp_probe ? 1 : 0);
+
+    if (config.keepalive_time_ms > 0) {
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, to_channel_arg(config.keepalive_time_ms));
+    }
+    if (config.keepalive_timeout_ms > 0) {
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, to_channel_arg(config.keepalive_timeout_ms));
+    }
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, config.keepalive_permit_without_calls ? 1 : 0);
+    if (config.min_client_ping_interval_ms > 0) {
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, to_channel_arg(config.min_client_ping_interval_ms));
+    }
+
+    if (!config.default_compression.empty()) {
+        grpc_compression_algorithm algorithm;
+        if (parse_compression(config.default_compression, algorithm)) {
+            builder.SetDefaultCompressionAlgorithm(algorithm);
+        }
+        else {
+            SERVER_LOG(WARNING) << "Ignoring unknown default compression '" << config.default_compression << "'";
+        }
+    }
+}
+
 bool server::init_server() {
+    return init_server(server_config::from_env());
+}
+
+bool server::init_server(const server_config &config) {
     if (_did_init) {
         return true;
     }
 
+    _config = config;
+    logger::get_logger().init(_config.log_level, _config.log_sample_rate);
+    admission_control::get_admission_control().init(_config.max_in_flight, _config.max_queue_latency_us);
     _shutting_down.store(false);
-    _service = std::make_shared<ExampleService::AsyncService>();
+    handler_base::start_accepting_requests();
+    init_handlers_pools();
 
-    auto server_address = "0.0.0.0";
-    auto server_port = 6212;
+    std::vector<std::string> addresses;
+    if (!_config.address.empty()) {
+        addresses.emplace_back(_config.address + ":" + std::to_string(_config.port));
+    }
+    std::stringstream listeners(_config.listeners);
+    std::string listener;
+    while (std::getline(listeners, listener, ',')) {
+        if (!listener.empty()) {
+            addresses.emplace_back(listener);
+        }
+    }
     std::stringstream stream;
-    stream << server_address << ":" << server_port;
-    std::string server_address_str(stream.str());
+    for (auto &address : addresses) {
+        stream << (stream.tellp() > 0 ? ", " : "") << address;
+    }
+    std::string server_address_str(addresses.empty() ? "in-process channels only" : stream.str());
 
-    auto max_message_size = 10 * 1024 * 1024;
     ServerBuilder builder;
+    apply_builder_options(_config, builder);
 
-    // Set max message size.
-    builder.SetMaxMessageSize(max_message_size);
-    builder.SetMaxSendMessageSize(max_message_size);
-    builder.SetMaxReceiveMessageSize(max_message_size);
-
-    // Listen on the given address without any authentication mechanism.
-    builder.AddListeningPort(server_address_str, grpc::InsecureServerCredentials());
-    builder.RegisterService(_service.get());
-
-    // Get hold of the completion queue used for the asynchronous communication
-    // with the gRPC runtime.
-
-    _completion_queue = builder.AddCompletionQueue();
+    // Listen on the given addresses without any authentication mechanism.
+    for (auto &address : addresses) {
+        builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    }
+    if (_config.callback_api) {
+        if (_config.raw_server_ping) {
+            SERVER_LOG(WARNING) << "raw_server_ping has no callback api counterpart, ServerPing is served from protobuf messages";
+        }
+        _callback_service = std::make_unique<example_callback_service>();
+        builder.RegisterService(_callback_service.get());
+    }
+    else {
+        _service = std::make_shared<example_service>(_config.raw_server_ping);
+        builder.RegisterService(_service.get());
+
+        // Get hold of the completion queues used for the asynchronous communication
+        // with the gRPC runtime.
+        for (uint32_t i = 0; i < _config.completion_queues; ++i) {
+            _completion_queues.emplace_back(builder.AddCompletionQueue());
+        }
+    }
 
     // Finally assemble the server.
     _server = builder.BuildAndStart();
+    if (!_server) {
+        SERVER_LOG(ERROR) << "Failed starting the grpc server on " << server_address_str;
+        _completion_queues.clear();
+        _service.reset();
+        _callback_service.reset();
+        handlers_pool::get_pool().close();
+        return false;
+    }
 
-    _server_thread = std::make_unique<thread>(std::function<void(server *)>(&server::handle_requests_queue), this);
+    uint32_t thread_index = 0;
+    for (auto &completion_queue : _completion_queues) {
+        for (uint32_t i = 0; i < _config.threads_per_queue; ++i, ++thread_index) {
+            auto server_thread = std::make_unique<thread>(&server::handle_requests_queue, this, completion_queue.get());
+            if (_config.pin_threads) {
+                pin_thread(*server_thread, thread_index);
+            }
+            _server_threads.emplace_back(std::move(server_thread));
+        }
+        init_rpc_handlers(completion_queue.get());
+    }
+    _housekeeping_thread = std::make_unique<thread>(&server::run_housekeeping, this);
 
-    init_rpc_handlers();
+    if (_config.callback_api) {
+        SERVER_LOG(INFO) << "Serving on " << server_address_str << " with the callback api";
+        _did_init = true;
+        return true;
+    }
+    SERVER_LOG(INFO) << "Serving on " << server_address_str << " with " << _config.completion_queues << " completion queue(s) x " << _config.threads_per_queue << " thread(s), "
+                     << _config.server_ping_handlers << " ServerPing, " << _config.server_ping_batch_handlers << " ServerPingBatch, " << _config.version_get_handlers << " VersionGet, "
+                     << _config.server_ping_stream_handlers << " ServerPingStream and " << _config.server_stats_handlers << " ServerStats handlers per queue"
+                     << (_config.max_handlers_per_type > 0 ? ", growing up to " + std::to_string(_config.max_handlers_per_type) + " per type under load" : "");
 
     _did_init = true;
     return true;
@@ -124,31 +364,68 @@ void server::close_server() {
         return;
     }
 
-    cout << "Closing the grpc server..." << endl;
+    SERVER_LOG(INFO) << "Closing the grpc server...";
 
-    _shutting_down.store(true);
-    _server->Shutdown();
-    _completion_queue->Shutdown();
+    {
+        std::lock_guard lk(_housekeeping_mutex);
+        _shutting_down.store(true);
+    }
+    _housekeeping_cv.notify_all();
+    if (_housekeeping_thread) {
+        _housekeeping_thread->join();
+        _housekeeping_thread.reset();
+    }
+    handler_base::stop_accepting_requests();
+
+    // New calls are refused from here on, calls in flight get the grace period to finish before they are cancelled.
+    // Handlers that complete meanwhile are released by the queue threads instead of being re-armed.
+    auto deadline = system_clock::now() + std::chrono::milliseconds(_config.shutdown_grace_ms);
+    _server->Shutdown(deadline);
+    if (system_clock::now() >= deadline) {
+        SERVER_LOG(WARNING) << "Calls still in flight after the " << _config.shutdown_grace_ms << "ms shutdown grace period were cancelled";
+    }
 
-    if (_server_thread && _server_thread->joinable()) {
-        _server_thread->join();
+    // Every call is over by now, but the queue threads may still be running handlers through their last tags, and a
+    // handler may post to its queue from there. Posting to a completion queue that is shut down aborts, so the queues
+    // are only shut down once every handler was released.
+    auto drain_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_config.shutdown_grace_ms);
+    if (auto left = handler_base::wait_for_release(drain_deadline)) {
+        SERVER_LOG(WARNING) << left << " handlers were not released before the completion queues were shut down";
+    }
+    for (auto &completion_queue : _completion_queues) {
+        completion_queue->Shutdown();
     }
 
-    // Make sure the queue is empty before closing it.
-    void* ignored_tag;
-    bool ignored_ok;
-    while (_completion_queue->Next(&ignored_tag, &ignored_ok)) { }
+    for (auto &server_thread : _server_threads) {
+        if (server_thread && server_thread->joinable()) {
+            server_thread->join();
+        }
+    }
 
-    _server_thread.reset();
-    _server_thread = nullptr;
+    // The threads drained the queues until they were shut down, this only catches tags left by threads that failed.
+    // Every tag left is a handler that is no longer needed.
+    void* rpc_tag;
+    bool ignored_ok;
+    for (auto &completion_queue : _completion_queues) {
+        while (completion_queue->Next(&rpc_tag, &ignored_ok)) {
+            if (rpc_tag) {
+                static_cast<handler_base *>(rpc_tag)->release();
+            }
+        }
+    }
 
-    _completion_queue.reset();
-    _completion_queue = nullptr;
+    _server_threads.clear();
+    _completion_queues.clear();
+    handlers_pool::get_pool().close();
+    _handler_groups.clear();
 
     _service.reset();
     _service = nullptr;
+    _callback_service.reset();
 
     _did_init = false;
+    SERVER_LOG(INFO) << "The grpc server is closed";
+    logger::get_logger().flush();
 }
 
 server::~server() {
@@ -7,13 +7,21 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
 #include <thread>
 #include <memory>
+#include <vector>
 
 #include "example/v1/example.grpc.pb.h"
 #include "example/v1/example.pb.h"
+#include "callback_service.h"
 #include "handlers.h"
+#include "logger.h"
 #include "memory_pool.h"
+#include "server_config.h"
+#include "server_metrics.h"
 
 using namespace grpc;
 using namespace example::v1;
@@ -32,24 +40,51 @@ public:
 
     virtual ~server();
     bool init_server();
+    bool init_server(const server_config &config);
     void close_server();
+    // Prints the metrics of every completion queue thread, safe to call while the server is running.
+    void dump_metrics(std::ostream &out);
+    // Same as dump_metrics(), written to stdout.
+    void print_metrics();
+    // A channel to the running server for callers in the same process, its calls skip the sockets and HTTP/2 framing
+    // (messages are still serialized). nullptr before init_server().
+    std::shared_ptr<grpc::Channel> in_process_channel(const grpc::ChannelArguments &args = grpc::ChannelArguments());
 
 private:
-    server() : _did_init(false), _server_thread(nullptr), _service(nullptr) {}
+    server() : _did_init(false), _service(nullptr) {
+        // Constructed first so the logger singleton is destroyed after the server's.
+        logger::get_logger();
+    }
     server(const server &other) = delete;
     bool is_server_shutting_down() {
         return _shutting_down.load();
     }
 
-    void init_rpc_handlers();
-    void handle_requests_queue();
+    template <class H>
+    void init_handlers_pool(const std::string &name, uint32_t count);
+    void init_handlers_pools();
+    template <class H>
+    bool post_rpc_handlers(uint32_t count, grpc::ServerCompletionQueue *completion_queue);
+    void init_rpc_handlers(grpc::ServerCompletionQueue *completion_queue);
+    void handle_requests_queue(grpc::ServerCompletionQueue *completion_queue);
+    void pin_thread(thread &server_thread, uint32_t thread_index);
+    void run_housekeeping();
 
-    std::unique_ptr<thread>                         _server_thread;
-    std::unique_ptr<grpc::ServerCompletionQueue>    _completion_queue;
-    std::shared_ptr<ExampleService::AsyncService>   _service;
+    server_config                                               _config;
+    std::vector<std::unique_ptr<thread>>                        _server_threads;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>>   _completion_queues;
+    // Outlive every handler, they are only cleared once handlers_pool is closed.
+    std::vector<std::unique_ptr<handler_group>>                 _handler_groups;
+    service_ptr                                     _service;
+    // Only in the callback api mode, _service and the completion queues are only used otherwise.
+    std::unique_ptr<example_callback_service>       _callback_service;
     bool                                            _did_init;
     std::unique_ptr<Server>                         _server;
     std::atomic_bool                                _shutting_down;
+    // Trims handlers_pool and dumps the metrics periodically.
+    std::unique_ptr<thread>                         _housekeeping_thread;
+    std::mutex                                      _housekeeping_mutex;
+    std::condition_variable                         _housekeeping_cv;
     mem_pool                                        _rpc_pool;
 };
 
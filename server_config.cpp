@@ -0,0 +1,144 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "server_config.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+using std::endl;
+using std::cout;
+
+// Where the settings are read from: the environment, with overrides on top. When names is set it only records the
+// names it is asked for and has no values, so nothing is parsed (or reported invalid).
+struct settings_source {
+    const server_config::settings   *overrides = nullptr;
+    std::vector<std::string>        *names = nullptr;
+
+    const char *get(const char *name) const {
+        if (names != nullptr) {
+            names->emplace_back(name);
+            return nullptr;
+        }
+        if (overrides != nullptr) {
+            auto it = overrides->find(name);
+            if (it != overrides->end()) {
+                return it->second.empty() ? nullptr : it->second.c_str();
+            }
+        }
+        auto value = ::getenv(name);
+        if (value == nullptr || *value == '\0') {
+            return nullptr;
+        }
+        return value;
+    }
+};
+
+static void load_env(const settings_source &source, const char *name, std::string &field) {
+    if (auto value = source.get(name)) {
+        field = value;
+    }
+}
+
+template <class T>
+static void load_env(const settings_source &source, const char *name, T &field, T min_value) {
+    auto value = source.get(name);
+    if (value == nullptr) {
+        return;
+    }
+    char *end = nullptr;
+    auto parsed = ::strtoull(value, &end, 10);
+    if (*end != '\0' || parsed < min_value || parsed > std::numeric_limits<T>::max()) {
+        cout << "Ignoring invalid value '" << value << "' of " << name << endl;
+        return;
+    }
+    field = static_cast<T>(parsed);
+}
+
+static void load_env(const settings_source &source, const char *name, log_level_e &field) {
+    auto value = source.get(name);
+    if (value != nullptr && !parse_log_level(value, field)) {
+        cout << "Ignoring invalid value '" << value << "' of " << name << endl;
+    }
+}
+
+static void load_env(const settings_source &source, const char *name, bool &field) {
+    auto value = source.get(name);
+    if (value == nullptr) {
+        return;
+    }
+    std::string str(value);
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (str == "1" || str == "true" || str == "yes" || str == "on") {
+        field = true;
+    }
+    else if (str == "0" || str == "false" || str == "no" || str == "off") {
+        field = false;
+    }
+    else {
+        cout << "Ignoring invalid value '" << value << "' of " << name << endl;
+    }
+}
+
+static server_config load_config(const settings_source &source) {
+    server_config config;
+    load_env(source, "GRPC_EXAMPLE_ADDRESS", config.address);
+    load_env<uint16_t>(source, "GRPC_EXAMPLE_PORT", config.port, 1);
+    load_env(source, "GRPC_EXAMPLE_LISTENERS", config.listeners);
+    load_env(source, "GRPC_EXAMPLE_CALLBACK_API", config.callback_api);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_COMPLETION_QUEUES", config.completion_queues, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_THREADS_PER_QUEUE", config.threads_per_queue, 1);
+    load_env(source, "GRPC_EXAMPLE_PIN_THREADS", config.pin_threads);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_SERVER_PING_HANDLERS", config.server_ping_handlers, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_VERSION_GET_HANDLERS", config.version_get_handlers, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_SERVER_PING_STREAM_HANDLERS", config.server_ping_stream_handlers, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_SERVER_PING_BATCH_HANDLERS", config.server_ping_batch_handlers, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_SERVER_STATS_HANDLERS", config.server_stats_handlers, 1);
+    load_env(source, "GRPC_EXAMPLE_RAW_SERVER_PING", config.raw_server_ping);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MAX_HANDLERS_PER_TYPE", config.max_handlers_per_type, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_POOL_IDLE_RELEASE_SEC", config.pool_idle_release_sec, 0);
+    load_env(source, "GRPC_EXAMPLE_HUGE_PAGES", config.huge_pages);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MAX_MESSAGE_SIZE", config.max_message_size, 1);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_RESOURCE_QUOTA_MB", config.resource_quota_mb, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MAX_CONCURRENT_STREAMS", config.max_concurrent_streams, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_HTTP2_STREAM_WINDOW_BYTES", config.http2_stream_window_bytes, 0);
+    load_env(source, "GRPC_EXAMPLE_HTTP2_BDP_PROBE", config.http2_bdp_probe);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_KEEPALIVE_TIME_MS", config.keepalive_time_ms, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_KEEPALIVE_TIMEOUT_MS", config.keepalive_timeout_ms, 0);
+    load_env(source, "GRPC_EXAMPLE_KEEPALIVE_PERMIT_WITHOUT_CALLS", config.keepalive_permit_without_calls);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MIN_CLIENT_PING_INTERVAL_MS", config.min_client_ping_interval_ms, 0);
+    load_env(source, "GRPC_EXAMPLE_DEFAULT_COMPRESSION", config.default_compression);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MAX_IN_FLIGHT", config.max_in_flight, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_MAX_QUEUE_LATENCY_US", config.max_queue_latency_us, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_METRICS_INTERVAL_SEC", config.metrics_interval_sec, 0);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_SHUTDOWN_GRACE_MS", config.shutdown_grace_ms, 0);
+    load_env(source, "GRPC_EXAMPLE_LOG_LEVEL", config.log_level);
+    load_env<uint32_t>(source, "GRPC_EXAMPLE_LOG_SAMPLE_RATE", config.log_sample_rate, 1);
+    return config;
+}
+
+server_config server_config::from_env() {
+    return load_config(settings_source());
+}
+
+server_config server_config::from_env(const settings &overrides) {
+    settings_source source;
+    source.overrides = &overrides;
+    return load_config(source);
+}
+
+bool server_config::is_setting(const std::string &name) {
+    static const std::vector<std::string> names = [] {
+        std::vector<std::string> names;
+        settings_source source;
+        source.names = &names;
+        load_config(source);
+        return names;
+    }();
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
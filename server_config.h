@@ -0,0 +1,109 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_SERVER_CONFIG_H
+#define GRPC_EXAMPLE_SERVER_CONFIG_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "logger.h"
+
+// Runtime settings of the grpc server, every field can be overridden by a GRPC_EXAMPLE_<FIELD> environment variable.
+struct server_config {
+    // An empty address leaves out the TCP listener, the server is then only reached over listeners and in-process.
+    std::string     address = "0.0.0.0";
+    uint16_t        port = 6212;
+    // More addresses to listen on, comma separated. Co-located clients skip the TCP stack over a unix domain socket,
+    // e.g. "unix:/tmp/grpc_example.sock".
+    std::string     listeners;
+
+    // Serve the rpcs on gRPC's callback api instead of completion queues. The completion queue and thread settings
+    // don't apply then, the handler counts size the reactor pools.
+    bool            callback_api = false;
+
+    // Number of completion queues, each one gets its own set of pre-posted handlers.
+    uint32_t        completion_queues = 1;
+    // Number of threads draining every completion queue.
+    uint32_t        threads_per_queue = 1;
+    // Pin every completion queue thread to a single core (round robin over the available cores).
+    bool            pin_threads = false;
+
+    // Number of handlers of every rpc type kept armed on each completion queue, that is how many calls of that type
+    // a queue takes in parallel before new ones wait in gRPC core. handlers_pool is sized from these.
+    uint32_t        server_ping_handlers = 16;
+    uint32_t        version_get_handlers = 4;
+    // A ServerPingStream handler serves a single stream for its whole life, so this is also the number of streams a
+    // queue serves at once.
+    uint32_t        server_ping_stream_handlers = 4;
+    uint32_t        server_ping_batch_handlers = 4;
+    uint32_t        server_stats_handlers = 1;
+    // Serve ServerPing from the raw request bytes, without parsing or serializing protobuf messages.
+    bool            raw_server_ping = false;
+    // Under load a queue posts more handlers of a type, up to this many, and releases them once the load drops.
+    // Counts below a type's configured handlers leave that type at its configured count, 0 disables growing.
+    uint32_t        max_handlers_per_type = 0;
+
+    // handlers_pool gives back to the OS the slabs that held no handler for this long, 0 keeps them.
+    uint32_t        pool_idle_release_sec = 30;
+    // Back handlers_pool with MAP_HUGETLB pages when some are reserved (vm.nr_hugepages), with transparent huge
+    // pages otherwise.
+    bool            huge_pages = false;
+
+    // Settings of gRPC itself, applied to the ServerBuilder. 0 (or empty) keeps gRPC's default.
+    // Largest message received or sent, in bytes.
+    uint32_t        max_message_size = 10 * 1024 * 1024;
+    // Memory gRPC may take for its buffers over all connections and calls, past it reads are held back and new
+    // connections refused. This is what bounds the memory per connection under many connections.
+    uint32_t        resource_quota_mb = 0;
+    // Streams a client may have open at once on a single connection (HTTP/2 SETTINGS_MAX_CONCURRENT_STREAMS).
+    uint32_t        max_concurrent_streams = 0;
+    // Initial HTTP/2 flow control window of every stream, in bytes. BDP probing grows the windows from there to match
+    // the connection's bandwidth-delay product, without it they stay at their initial size.
+    uint32_t        http2_stream_window_bytes = 0;
+    bool            http2_bdp_probe = true;
+    // Ping an idle connection every keepalive_time_ms and close it when a ping isn't acknowledged within
+    // keepalive_timeout_ms.
+    uint32_t        keepalive_time_ms = 0;
+    uint32_t        keepalive_timeout_ms = 0;
+    // Send keepalive pings, and accept the clients', on connections without calls in flight.
+    bool            keepalive_permit_without_calls = false;
+    // Clients pinging more often than this without sending data get their connection closed.
+    uint32_t        min_client_ping_interval_ms = 0;
+    // Compression of the responses when the call doesn't ask for any: none, deflate or gzip. Clients that don't
+    // accept the algorithm get uncompressed responses.
+    std::string     default_compression;
+
+    // Admission control: calls beyond max_in_flight, or arriving while the queue latency (the average time from Finish
+    // until the queue thread gets to the completion) is above max_queue_latency_us, fail with RESOURCE_EXHAUSTED.
+    // 0 disables the matching watermark.
+    uint32_t        max_in_flight = 0;
+    uint32_t        max_queue_latency_us = 0;
+
+    // Print the latency histograms and counters every that many seconds, 0 disables the periodic dump.
+    uint32_t        metrics_interval_sec = 0;
+
+    // On shutdown, how long calls in flight get to finish before they are cancelled.
+    uint32_t        shutdown_grace_ms = 5000;
+
+    // Per-rpc messages are logged at debug level, and only one out of log_sample_rate of them.
+    log_level_e     log_level = LOG_LEVEL_INFO;
+    uint32_t        log_sample_rate = 1;
+
+    uint32_t max_handlers(uint32_t handlers) const {
+        return handlers > max_handlers_per_type ? handlers : max_handlers_per_type;
+    }
+
+    // Values of settings by their GRPC_EXAMPLE_<FIELD> name.
+    using settings = std::map<std::string, std::string>;
+
+    static server_config from_env();
+    // The environment's settings with overrides on top, the environment itself is left as is.
+    static server_config from_env(const settings &overrides);
+    // Whether name is one of the GRPC_EXAMPLE_<FIELD> settings.
+    static bool is_setting(const std::string &name);
+};
+
+#endif //GRPC_EXAMPLE_SERVER_CONFIG_H
@@ -0,0 +1,139 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "server_metrics.h"
+
+#include <algorithm>
+#include <iomanip>
+
+const char *rpc_method_name(rpc_method_e method) {
+    switch (method) {
+        case RPC_METHOD_SERVER_PING:
+            return "ServerPing";
+        case RPC_METHOD_VERSION_GET:
+            return "VersionGet";
+        case RPC_METHOD_SERVER_PING_STREAM:
+            return "PingStream";
+        case RPC_METHOD_SERVER_PING_BATCH:
+            return "PingBatch";
+        case RPC_METHOD_SERVER_STATS:
+            return "ServerStats";
+        default:
+            return "Unknown";
+    }
+}
+
+const char *rpc_phase_name(rpc_phase_e phase) {
+    switch (phase) {
+        case RPC_PHASE_WAIT:
+            return "wait";
+        case RPC_PHASE_PROCESS:
+            return "process";
+        case RPC_PHASE_COMPLETE:
+            return "complete";
+        default:
+            return "unknown";
+    }
+}
+
+const char *server_counter_name(server_counter_e counter) {
+    switch (counter) {
+        case SERVER_COUNTER_POOL_EXHAUSTED:
+            return "pool_exhausted";
+        case SERVER_COUNTER_FAILED_TAGS:
+            return "failed_tags";
+        case SERVER_COUNTER_SHED:
+            return "shed";
+        default:
+            return "unknown";
+    }
+}
+
+thread_metrics *server_metrics::register_thread() {
+    {
+        std::lock_guard lk(_threads_mutex);
+        if (!_free_threads.empty()) {
+            // The mutex orders the previous owner's last writes before this thread's first ones.
+            auto ptr = _free_threads.back();
+            _free_threads.pop_back();
+            return ptr;
+        }
+    }
+    auto metrics = std::make_unique<thread_metrics>();
+    auto ptr = metrics.get();
+    std::lock_guard lk(_threads_mutex);
+    _threads.emplace_back(std::move(metrics));
+    return ptr;
+}
+
+void server_metrics::unregister_thread(thread_metrics *metrics) {
+    std::lock_guard lk(_threads_mutex);
+    _free_threads.push_back(metrics);
+}
+
+metrics_snapshot server_metrics::snapshot() {
+    metrics_snapshot snapshot;
+    {
+        std::lock_guard lk(_threads_mutex);
+        for (auto &metrics : _threads) {
+            for (int method = 0; method < RPC_METHOD_LAST; ++method) {
+                for (int phase = 0; phase < RPC_PHASE_LAST; ++phase) {
+                    snapshot.latency[method][phase].merge(metrics->latency[method][phase]);
+                }
+            }
+            for (int counter = 0; counter < SERVER_COUNTER_LAST; ++counter) {
+                snapshot.counters[counter] += metrics->counters[counter].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    arena_snapshot(snapshot.arena);
+    return snapshot;
+}
+
+void server_metrics::arena_snapshot(arena_usage_totals (&totals)[RPC_METHOD_LAST]) {
+    std::lock_guard lk(_threads_mutex);
+    for (auto &metrics : _threads) {
+        for (int method = 0; method < RPC_METHOD_LAST; ++method) {
+            auto &usage = metrics->arena[method];
+            totals[method].resets += usage.resets.load(std::memory_order_relaxed);
+            totals[method].bytes_used += usage.bytes_used.load(std::memory_order_relaxed);
+            totals[method].high_water = std::max(totals[method].high_water, usage.high_water.load(std::memory_order_relaxed));
+            totals[method].overflows += usage.overflows.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void metrics_snapshot::print(std::ostream &out) const {
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+    out << std::left << std::setw(12) << "rpc" << std::setw(10) << "phase" << std::right << std::setw(12) << "count"
+        << std::setw(12) << "mean(us)" << std::setw(12) << "p50(us)" << std::setw(12) << "p99(us)"
+        << std::setw(12) << "p999(us)" << std::setw(12) << "max(us)" << std::endl;
+    for (int method = 0; method < RPC_METHOD_LAST; ++method) {
+        for (int phase = 0; phase < RPC_PHASE_LAST; ++phase) {
+            auto &histogram = latency[method][phase];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            out << std::left << std::setw(12) << rpc_method_name(static_cast<rpc_method_e>(method))
+                << std::setw(10) << rpc_phase_name(static_cast<rpc_phase_e>(phase)) << std::right
+                << std::setw(12) << histogram.count() << std::setw(12) << histogram.mean() / 1000.0
+                << std::setw(12) << histogram.percentile(50) / 1000.0 << std::setw(12) << histogram.percentile(99) / 1000.0
+                << std::setw(12) << histogram.percentile(99.9) / 1000.0 << std::setw(12) << histogram.max() / 1000.0 << std::endl;
+        }
+    }
+    for (int counter = 0; counter < SERVER_COUNTER_LAST; ++counter) {
+        out << server_counter_name(static_cast<server_counter_e>(counter)) << "=" << counters[counter]
+            << (counter + 1 < SERVER_COUNTER_LAST ? " " : "\n");
+    }
+    for (int method = 0; method < RPC_METHOD_LAST; ++method) {
+        auto &totals = arena[method];
+        if (totals.resets == 0) {
+            continue;
+        }
+        out << "arena " << rpc_method_name(static_cast<rpc_method_e>(method)) << " resets=" << totals.resets << " mean_bytes="
+            << static_cast<double>(totals.bytes_used) / totals.resets << " high_water_bytes=" << totals.high_water << " overflows=" << totals.overflows << "\n";
+    }
+    out.flags(flags);
+}
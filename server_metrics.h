@@ -0,0 +1,152 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_SERVER_METRICS_H
+#define GRPC_EXAMPLE_SERVER_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "histogram.h"
+
+enum rpc_method_e {
+    RPC_METHOD_SERVER_PING = 0,
+    RPC_METHOD_VERSION_GET = 1,
+    RPC_METHOD_SERVER_PING_STREAM = 2,
+    RPC_METHOD_SERVER_PING_BATCH = 3,
+    RPC_METHOD_SERVER_STATS = 4,
+    RPC_METHOD_LAST = 5
+};
+
+// The stretches of a handler's life that get a histogram each.
+enum rpc_phase_e {
+    // From posting the handler (Request*) until its PROCESS tag is taken off the completion queue. A handler is
+    // posted before any client calls, so on a quiet server this is mostly time spent waiting for a call.
+    RPC_PHASE_WAIT = 0,
+    // From taking the PROCESS tag until the response is handed to Finish, for streams from every read to its write.
+    RPC_PHASE_PROCESS = 1,
+    // From Finish until the COMPLETE tag is taken off the completion queue, i.e. sending the response.
+    RPC_PHASE_COMPLETE = 2,
+    RPC_PHASE_LAST = 3
+};
+
+enum server_counter_e {
+    SERVER_COUNTER_POOL_EXHAUSTED = 0,
+    SERVER_COUNTER_FAILED_TAGS = 1,
+    SERVER_COUNTER_SHED = 2,
+    SERVER_COUNTER_LAST = 3
+};
+
+const char *rpc_method_name(rpc_method_e method);
+const char *rpc_phase_name(rpc_phase_e phase);
+const char *server_counter_name(server_counter_e counter);
+
+// Arena usage of one rpc's calls, recorded when a handler resets its arena. Single writer, same as the histograms.
+struct arena_usage {
+    std::atomic<uint64_t>   resets{0};
+    std::atomic<uint64_t>   bytes_used{0};
+    std::atomic<uint64_t>   high_water{0};
+    std::atomic<uint64_t>   overflows{0};
+
+    void record(uint64_t used, bool overflow) {
+        resets.store(resets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytes_used.store(bytes_used.load(std::memory_order_relaxed) + used, std::memory_order_relaxed);
+        if (used > high_water.load(std::memory_order_relaxed)) {
+            high_water.store(used, std::memory_order_relaxed);
+        }
+        if (overflow) {
+            overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+};
+
+struct arena_usage_totals {
+    uint64_t    resets = 0;
+    uint64_t    bytes_used = 0;
+    uint64_t    high_water = 0;
+    uint64_t    overflows = 0;
+};
+
+// Metrics written by a single thread, the histograms and counters are relaxed atomics so they can be read while
+// the thread keeps recording.
+struct thread_metrics {
+    latency_histogram       latency[RPC_METHOD_LAST][RPC_PHASE_LAST];
+    std::atomic<uint64_t>   counters[SERVER_COUNTER_LAST] = {};
+    arena_usage             arena[RPC_METHOD_LAST];
+
+    void increment(server_counter_e counter) {
+        counters[counter].store(counters[counter].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+// Totals of every thread's metrics at the time of the snapshot.
+struct metrics_snapshot {
+    latency_histogram   latency[RPC_METHOD_LAST][RPC_PHASE_LAST];
+    uint64_t            counters[SERVER_COUNTER_LAST] = {};
+    arena_usage_totals  arena[RPC_METHOD_LAST];
+
+    void print(std::ostream &out) const;
+};
+
+// Every thread that records gets its own thread_metrics on first use, so the hot path never shares a cache line
+// with another thread. The blocks outlive their threads so their counts stay in the totals, the block of a thread that
+// exited is handed to the next thread that starts recording. Threads that come and go (the callback executor's) then
+// reuse a few blocks instead of adding one each.
+class server_metrics {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static server_metrics &get_metrics() {
+        static server_metrics _metrics;
+        return _metrics;
+    }
+
+    thread_metrics &local() {
+        thread_local thread_slot _slot{register_thread()};
+        return *_slot.metrics;
+    }
+
+    void record(rpc_method_e method, rpc_phase_e phase, clock::time_point from, clock::time_point to) {
+        local().latency[method][phase].record(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+    }
+
+    void increment(server_counter_e counter) {
+        local().increment(counter);
+    }
+
+    void record_arena(rpc_method_e method, uint64_t used, bool overflow) {
+        local().arena[method].record(used, overflow);
+    }
+
+    metrics_snapshot snapshot();
+    // Only the arena usage part of snapshot(), without merging the histograms.
+    void arena_snapshot(arena_usage_totals (&totals)[RPC_METHOD_LAST]);
+
+private:
+    // Gives the thread's block back when the thread exits.
+    struct thread_slot {
+        thread_metrics  *metrics;
+
+        ~thread_slot() {
+            get_metrics().unregister_thread(metrics);
+        }
+    };
+
+    server_metrics() = default;
+    server_metrics(const server_metrics &other) = delete;
+
+    thread_metrics *register_thread();
+    void unregister_thread(thread_metrics *metrics);
+
+    std::mutex                                      _threads_mutex;
+    std::vector<std::unique_ptr<thread_metrics>>    _threads;
+    // Blocks of exited threads, taken over by new threads before a new block is allocated.
+    std::vector<thread_metrics *>                   _free_threads;
+};
+
+#endif //GRPC_EXAMPLE_SERVER_METRICS_H
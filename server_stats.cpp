@@ -0,0 +1,89 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#include "server_stats.h"
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "memory_pool.h"
+#include "server_metrics.h"
+
+using namespace example::v1;
+
+static void collect_handler_pools(ServerStatsResponse &response) {
+    handlers_pool::get_pool().for_each_pool([&response](mem_pool &pool) {
+        auto *stats = response.add_handler_pools();
+        stats->set_name(pool.name());
+        stats->set_slot_size(pool.node_size());
+        stats->set_allocated(pool.allocated_count());
+        stats->set_free(pool.free_count());
+        stats->set_capacity(pool.capacity());
+        stats->set_committed_bytes(pool.committed_bytes());
+    });
+}
+
+static void collect_arenas(ServerStatsResponse &response) {
+    arena_usage_totals totals[RPC_METHOD_LAST];
+    server_metrics::get_metrics().arena_snapshot(totals);
+    for (int method = 0; method < RPC_METHOD_LAST; ++method) {
+        if (totals[method].resets == 0) {
+            continue;
+        }
+        auto *stats = response.add_arenas();
+        stats->set_rpc(rpc_method_name(static_cast<rpc_method_e>(method)));
+        stats->set_resets(totals[method].resets);
+        stats->set_bytes_used(totals[method].bytes_used);
+        stats->set_high_water_bytes(totals[method].high_water);
+        stats->set_overflows(totals[method].overflows);
+    }
+}
+
+static void collect_allocator(AllocatorStats &stats) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    auto info = ::mallinfo2();
+#else
+    // The int fields of mallinfo wrap past 2GB.
+    auto info = ::mallinfo();
+#endif
+    stats.set_arena_bytes(info.arena);
+    stats.set_mmap_bytes(info.hblkhd);
+    stats.set_in_use_bytes(info.uordblks);
+    stats.set_free_bytes(info.fordblks);
+    stats.set_releasable_bytes(info.keepcost);
+}
+
+static void collect_process(ProcessMemoryStats &stats) {
+    uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size_pages = 0;
+    uint64_t resident_pages = 0;
+    if (statm >> size_pages >> resident_pages) {
+        stats.set_vm_size_bytes(size_pages * page_size);
+        stats.set_rss_bytes(resident_pages * page_size);
+    }
+
+    // smaps_rollup sums the mappings in the kernel, a single read whatever the number of mappings.
+    std::ifstream rollup("/proc/self/smaps_rollup");
+    std::string line;
+    uint64_t uss_kb = 0;
+    while (std::getline(rollup, line)) {
+        if (line.rfind("Private_Clean:", 0) == 0 || line.rfind("Private_Dirty:", 0) == 0) {
+            uss_kb += std::stoull(line.substr(line.find(':') + 1));
+        }
+    }
+    stats.set_uss_bytes(uss_kb * 1024);
+}
+
+void collect_server_stats(ServerStatsResponse &response) {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    response.set_timestamp_ms(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+    collect_handler_pools(response);
+    collect_arenas(response);
+    collect_allocator(*response.mutable_allocator());
+    collect_process(*response.mutable_process());
+}
@@ -0,0 +1,15 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_SERVER_STATS_H
+#define GRPC_EXAMPLE_SERVER_STATS_H
+
+#include "example/v1/example.pb.h"
+
+// Fills response with the server's memory usage as ServerStats serves it: handlers_pool occupancy per handler type,
+// arena usage per rpc, the malloc heap and the process' memory. Takes well under a millisecond, so dashboards can poll
+// it every second instead of sampling the process from the outside.
+void collect_server_stats(example::v1::ServerStatsResponse &response);
+
+#endif //GRPC_EXAMPLE_SERVER_STATS_H
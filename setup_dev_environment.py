@@ -9,6 +9,7 @@ googletest_dir_prefix = "googletest"
 spdlog_dir_prefix = "spdlog"
 grpc_dir_prefix = "grpc"
 zlib_dir_prefix = "zlib"
+benchmark_dir_prefix = "benchmark"
 
 def update_directory_paths(args):
     if args.clone_git:
@@ -47,6 +48,7 @@ def main():
     parser.add_argument("--zlib_url", default="https://github.com/madler/zlib/archive/refs/tags/v1.3.tar.gz", help="URL for zlib.")
     parser.add_argument("--grpc_url", default="https://github.com/grpc/grpc.git", help="URL for gRPC.")
     parser.add_argument("--grpc_version", default="v1.66.0", help="gRPC version.")
+    parser.add_argument("--benchmark_url", default="https://github.com/google/benchmark/archive/refs/tags/v1.9.0.tar.gz", help="URL for google benchmark.")
     parser.add_argument("--c_compiler", default="gcc", help="C compiler.")
     parser.add_argument("--cpp_compiler", default="g++", help="C++ compiler.")
     parser.add_argument("--clone_git", action="store_true", help="Whether to clone the Git repository.")
@@ -135,6 +137,21 @@ def main():
     run_command(f"cmake --build {grpc_build_dir} --config Debug -j {args.cores_to_use}")
     run_command(f"cmake --build {grpc_build_dir} --target install")
 
+    # Download and build google benchmark (used by grpc_example_bench)
+    benchmark_dir = f"{args.download_dir}/{benchmark_dir_prefix}-{get_directory_name_from_url(args.benchmark_url)}"
+    run_command(f"wget {args.benchmark_url} -P {args.download_dir}")
+    run_command(f"tar xfz {args.download_dir}/{args.benchmark_url.split('/')[-1]} -C {args.download_dir}")
+    benchmark_build_dir = os.path.join(benchmark_dir, "build")
+    os.makedirs(benchmark_build_dir, exist_ok=True)
+    benchmark_cmake_cmd = (
+        f"cmake -B {benchmark_build_dir} -DCMAKE_CXX_COMPILER={args.cpp_compiler} -DCMAKE_C_COMPILER={args.c_compiler} "
+        f"-DCMAKE_BUILD_TYPE=Release -DCMAKE_CXX_STANDARD=17 -DBENCHMARK_ENABLE_TESTING=OFF -DBENCHMARK_ENABLE_GTEST_TESTS=OFF "
+        f"-DCMAKE_INSTALL_PREFIX={args.install_dir} -S {benchmark_dir}/"
+    )
+    run_command(benchmark_cmake_cmd)
+    run_command(f"cmake --build {benchmark_build_dir} --config Release -j {args.cores_to_use}")
+    run_command(f"cmake --build {benchmark_build_dir} --target install")
+
     if args.create_dirs == "yes":
         shutil.rmtree(args.download_dir)
 
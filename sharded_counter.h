@@ -0,0 +1,53 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_SHARDED_COUNTER_H
+#define GRPC_EXAMPLE_SHARDED_COUNTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sched.h>
+#include <unistd.h>
+
+// A counter split in one cache line per core, so threads counting on different cores never write the same line. A
+// thread adds to the shard of the core it runs on, which stays correct if it migrates meanwhile (the shard is still
+// updated atomically, only its line may bounce). read() sums the shards: exact once the writers are done, and while
+// they run it is the total at some point during the read.
+class sharded_counter {
+public:
+    sharded_counter() {
+        auto cores = ::sysconf(_SC_NPROCESSORS_CONF);
+        _shard_count = cores > 0 ? static_cast<uint32_t>(cores) : 1;
+        _shards = std::make_unique<shard[]>(_shard_count);
+    }
+
+    void add(uint64_t value) {
+        local_shard().value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t read() const {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < _shard_count; ++i) {
+            total += _shards[i].value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> value{0};
+    };
+
+    shard &local_shard() {
+        // sched_getcpu is a vDSO call (served from rseq on recent glibc), no syscall.
+        auto cpu = ::sched_getcpu();
+        return _shards[cpu >= 0 ? static_cast<uint32_t>(cpu) % _shard_count : 0];
+    }
+
+    uint32_t                    _shard_count;
+    std::unique_ptr<shard[]>    _shards;
+};
+
+#endif //GRPC_EXAMPLE_SHARDED_COUNTER_H
@@ -0,0 +1,58 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+// sharded_counter as pings_so_far uses it: the total is exact once the writers are done, and a read right after an add
+// takes in every add the reading thread made before.
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "sharded_counter.h"
+
+namespace {
+
+constexpr int THREADS = 8;
+constexpr uint64_t PER_THREAD = 100000;
+
+TEST(sharded_counter_test, total_is_exact_once_the_writers_are_done) {
+    sharded_counter counter;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&counter] {
+            for (uint64_t i = 0; i < PER_THREAD; ++i) {
+                counter.add(1);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(counter.read(), THREADS * PER_THREAD);
+}
+
+TEST(sharded_counter_test, reads_after_adding_never_go_back) {
+    sharded_counter counter;
+    std::vector<std::thread> threads;
+    std::vector<int> failures(THREADS, 0);
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&counter, &failures, t] {
+            uint64_t last = 0;
+            for (uint64_t i = 1; i <= PER_THREAD; ++i) {
+                counter.add(1);
+                auto total = counter.read();
+                failures[t] += total < i || total < last;
+                last = total;
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (int t = 0; t < THREADS; ++t) {
+        EXPECT_EQ(failures[t], 0) << "thread " << t;
+    }
+}
+
+}
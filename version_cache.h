@@ -0,0 +1,75 @@
+//
+// Created by Dan Cohen on 11/11/2024.
+//
+
+#ifndef GRPC_EXAMPLE_VERSION_CACHE_H
+#define GRPC_EXAMPLE_VERSION_CACHE_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <grpcpp/grpcpp.h>
+
+#include "example/v1/example.pb.h"
+
+// The VersionGet response serialized once, handlers send it as is. Every update bumps the generation, handlers keep
+// their own reference to the serialized bytes and refresh it only when the generation they hold is stale, so a call
+// costs an atomic load and no protobuf work.
+class version_cache {
+public:
+    static constexpr const char *DEFAULT_VERSION = "v1.1";
+    static constexpr const char *DEFAULT_COMMIT_HASH = "abc123";
+
+    static version_cache &get_cache() {
+        static version_cache _cache;
+        return _cache;
+    }
+
+    // Replaces the version info, handlers pick up the new response on their next call.
+    void update(const std::string &version, const std::string &commit_hash) {
+        example::v1::VersionGetResponse response;
+        response.set_version(version);
+        response.set_commit_hash(commit_hash);
+        std::string serialized;
+        response.SerializeToString(&serialized);
+        grpc::Slice slice(serialized);
+
+        std::lock_guard lk(_mutex);
+        _response = grpc::ByteBuffer(&slice, 1);
+        _generation.fetch_add(1, std::memory_order_release);
+    }
+
+    uint64_t generation() const {
+        return _generation.load(std::memory_order_acquire);
+    }
+
+    // Points buffer at the current response (the slices are shared, not copied), returns the generation it belongs to.
+    uint64_t copy_response(grpc::ByteBuffer &buffer) {
+        std::lock_guard lk(_mutex);
+        buffer = _response;
+        return _generation.load(std::memory_order_relaxed);
+    }
+
+    // The same for callers that can't keep a response across calls (the callback handlers get a new buffer on every
+    // call): the reference is kept per thread instead, so the mutex is only taken by the first call after an update.
+    void copy_thread_response(grpc::ByteBuffer &buffer) {
+        thread_local grpc::ByteBuffer response;
+        thread_local uint64_t response_generation = 0;
+        if (response_generation != generation()) {
+            response_generation = copy_response(response);
+        }
+        buffer = response;
+    }
+
+private:
+    version_cache() : _generation(0) {
+        update(DEFAULT_VERSION, DEFAULT_COMMIT_HASH);
+    }
+    version_cache(const version_cache &other) = delete;
+
+    std::mutex              _mutex;
+    grpc::ByteBuffer        _response;
+    std::atomic<uint64_t>   _generation;
+};
+
+#endif //GRPC_EXAMPLE_VERSION_CACHE_H